@@ -0,0 +1,489 @@
+// benchmarks of microshell's core routines, built with `make bench`, run
+// from the repository root so that ./microshell.e is found
+#define MICROSHELL_NO_MAIN
+#include "../microshell.c"
+
+#include <time.h>
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Every allocation of the process, libc's own included, goes through these
+// and is counted, glibc's functions do the work. Frees aren't counted.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+uint64_t bench_allocations = 0;
+
+void *malloc(size_t size) {
+    bench_allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    bench_allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    bench_allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+// Results are printed one line per benchmark in the format of `go test -bench`
+// so that benchstat and similar tools can compare two versions:
+//   Benchmark<Name>/<case> <iterations> <ns> ns/op <allocations> allocs/op [<value> <unit>]...
+// everything else goes to stderr.
+void report(const char *name, long iterations, double seconds, uint64_t allocations, const char *extra) {
+    printf("Benchmark%s\t%ld\t%.1f ns/op\t%.2f allocs/op%s%s\n", name, iterations,
+            seconds / iterations * 1e9, (double)allocations / iterations, extra[0] ? "\t" : "", extra);
+    fflush(stdout);
+}
+
+#define BENCH_TIME 0.25 // seconds a benchmark runs for at least
+
+// Runs op like `go test -bench`: the iteration count grows until a run takes
+// BENCH_TIME, the last run is reported. Output of op goes to /dev/null.
+void measure(const char *name, void (*op)(void *), void *data) {
+    FILE *saved = stdout;
+    stdout = fopen("/dev/null", "w");
+    long n = 1;
+    double elapsed;
+    uint64_t allocations;
+    while (true) {
+        allocations = bench_allocations;
+        double start = now_seconds();
+        for (long i = 0; i < n; i++)
+            op(data);
+        elapsed = now_seconds() - start;
+        allocations = bench_allocations - allocations;
+        if (elapsed >= BENCH_TIME || n >= 1000000000)
+            break;
+        // aim 20% over the target, but grow at most 100 times per run
+        long next = elapsed > 0 ? n * BENCH_TIME * 1.2 / elapsed : n * 100;
+        n = next > n * 100 ? n * 100 : next <= n ? n + 1 : next;
+    }
+    fclose(stdout);
+    stdout = saved;
+    report(name, n, elapsed, allocations, "");
+}
+
+// xorshift64*, deterministic so that runs are comparable
+uint64_t bench_random_state = 0x9E3779B97F4A7C15ULL;
+uint64_t bench_random() {
+    bench_random_state ^= bench_random_state >> 12;
+    bench_random_state ^= bench_random_state << 25;
+    bench_random_state ^= bench_random_state >> 27;
+    return bench_random_state * 0x2545F4914F6CDD1DULL;
+}
+
+// fills buff with n newline separated numbers of the given kind, returns its length
+size_t generate_numbers(char *buff, int n, int kind) {
+    size_t length = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t r = bench_random();
+        switch (kind) {
+            case 0: { // short decimals, like in logs
+                length += sprintf(buff + length, "%d.%02d", (int)(r % 100000), (int)(r >> 32) % 100);
+                break;
+            }
+            case 1: { // random doubles printed with full precision
+                double value;
+                do {
+                    memcpy(&value, &r, sizeof(value));
+                    r = bench_random();
+                } while (!isfinite(value));
+                length += sprintf(buff + length, "%.17g", value);
+                break;
+            }
+            case 2: { // integers
+                length += sprintf(buff + length, "%llu", (unsigned long long)(r >> (r % 64)));
+                break;
+            }
+        }
+        buff[length++] = '\n';
+    }
+    buff[length] = '\0';
+    return length;
+}
+
+// keeps results alive so that the compiler can't skip the work
+volatile double bench_sink;
+
+void bench_parse_number() {
+    const int n = 2000000;
+    const char *kinds[] = {"short_decimals", "full_precision_doubles", "integers"};
+    char *buff = malloc((size_t)n * 32);
+    for (int kind = 0; kind < 3; kind++) {
+        size_t length = generate_numbers(buff, n, kind);
+        const char *end = buff + length;
+
+        double sum = 0;
+        double start = now_seconds();
+        for (const char *p = buff; p < end; p++) {
+            double value;
+            p = parse_number(p, end, &value);
+            sum += value;
+        }
+        double parse_number_time = now_seconds() - start;
+
+        double strtod_sum = 0;
+        start = now_seconds();
+        for (char *p = buff; p < end; p++) {
+            strtod_sum += strtod(p, &p);
+        }
+        double strtod_time = now_seconds() - start;
+
+        // results must be bit for bit identical
+        int mismatches = 0;
+        for (const char *p = buff; p < end; p++) {
+            double value;
+            char *q;
+            double expected = strtod(p, &q);
+            bool same = parse_number(p, end, &value) == q && memcmp(&value, &expected, sizeof(double)) == 0;
+            if (!same && mismatches++ < 5)
+                fprintf(stderr, "mismatch: %.*s -> %.17g, strtod: %.17g\n", (int)(q - p), p, value, expected);
+            p = q;
+        }
+        if (mismatches > 0)
+            fprintf(stderr, "parse_number %s: %d mismatches with strtod\n", kinds[kind], mismatches);
+
+        char name[64], extra[64];
+        sprintf(name, "ParseNumber/%s", kinds[kind]);
+        sprintf(extra, "%.1f MB/s", length / parse_number_time / 1e6);
+        report(name, n, parse_number_time, 0, extra);
+        sprintf(name, "Strtod/%s", kinds[kind]);
+        sprintf(extra, "%.1f MB/s", length / strtod_time / 1e6);
+        report(name, n, strtod_time, 0, extra);
+        bench_sink += sum + strtod_sum;
+    }
+    free(buff);
+}
+
+void bench_z_query() {
+    const int n = 50000;
+    // vocabulary of made up directory names
+    const char *syllables[] = {"ka", "lo", "mi", "ser", "ver", "pro", "ject", "src", "lib", "doc",
+                               "bu", "ild", "te", "st", "cli", "ent", "re", "lease", "tmp", "log"};
+    char words[300][16];
+    for (int i = 0; i < 300; i++) {
+        words[i][0] = '\0';
+        int parts = 1 + bench_random() % 3;
+        for (int j = 0; j < parts; j++)
+            strcat(words[i], syllables[bench_random() % 20]);
+        if (bench_random() % 4 == 0)
+            words[i][0] = toupper(words[i][0]);
+    }
+    char path[256];
+    for (int i = 0; i < n; i++) {
+        int length = 0;
+        int depth = 2 + bench_random() % 6;
+        for (int j = 0; j < depth; j++)
+            length += sprintf(path + length, "/%s", words[bench_random() % 300]);
+        z_add(path, length, 1 + bench_random() % 100, time(NULL) - bench_random() % 1000000, 0);
+    }
+    // substring, two substrings, fuzzy, no match
+    char *queries[][3] = {{"lease", NULL}, {"ser", "log"}, {"kmsv", NULL}, {"xyz", NULL}};
+    int counts[] = {1, 2, 1, 1};
+    for (int q = 0; q < 4; q++) {
+        const int runs = 50;
+        int matches_count = 0;
+        uint64_t allocations = bench_allocations;
+        double start = now_seconds();
+        for (int r = 0; r < runs; r++) {
+            struct ZMatch *matches;
+            matches_count = z_query(queries[q], counts[q], &matches);
+            free(matches);
+        }
+        double elapsed = now_seconds() - start;
+        char name[64], extra[64];
+        sprintf(name, "ZQuery/%s", queries[q][0]);
+        sprintf(extra, "%d directories\t%d matches", n, matches_count);
+        report(name, runs, elapsed, bench_allocations - allocations, extra);
+    }
+}
+
+// words are allocated once like in main, parse_arguments puts NULL after the
+// last one and words keeps it to put back
+struct ParseCase {
+    const char *line;
+    char **args;
+    char **words;
+};
+
+void parse_arguments_op(void *data) {
+    struct ParseCase *c = data;
+    int count = parse_arguments(c->line, c->args);
+    c->args[count] = c->words[count];
+}
+
+void bench_parse_arguments() {
+    static char long_word[1000], many_words[1000], quotes[1000], unterminated[1000];
+    memset(long_word, 'a', 990);
+    for (int i = 0; i < 990; i += 2)
+        memcpy(many_words + i, "a ", 2); // more words than max_word_count
+    for (int i = 0; i < 990; i += 3)
+        memcpy(quotes + i, i % 2 ? "'b'" : "\"a\"", 3);
+    unterminated[0] = '"';
+    memset(unterminated + 1, 'x', 989);
+    const char *cases[][2] = {
+        {"realistic/short", "ls -la"},
+        {"realistic/git", "git commit -m \"fix the parser\" --author='A U Thor <a@example.com>'"},
+        {"realistic/paths", "cp /home/user/projects/microshell/microshell.c /tmp/backup/microshell.c.bak"},
+        {"realistic/status", "echo last command returned $? and \"$?\" but not '$?'"},
+        {"realistic/substitution", "echo $(echo nested $(echo deep)) `pwd`"},
+        {"adversarial/long_word", long_word},
+        {"adversarial/many_words", many_words},
+        {"adversarial/quotes", quotes},
+        {"adversarial/unterminated", unterminated},
+    };
+    struct ParseCase c;
+    c.args = malloc(max_word_count * sizeof(char*));
+    c.words = malloc(max_word_count * sizeof(char*));
+    for (int i = 0; i < max_word_count; i++)
+        c.args[i] = c.words[i] = malloc(max_word_length);
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char name[64];
+        sprintf(name, "ParseArguments/%s", cases[i][0]);
+        c.line = cases[i][1];
+        measure(name, parse_arguments_op, &c);
+    }
+    free(c.args);
+    free_args(c.words);
+}
+
+void calc_op(void *data) {
+    char *argv[] = {"calc", data, NULL};
+    cmd_calc(2, argv);
+}
+
+// expressions of growing number of terms, floating point and exact integer ones
+void bench_calc() {
+    static char expression[1000];
+    const int sizes[] = {4, 16, 64, 128};
+    // groups open after '-', integer ones skip division to stay exact
+    const char *operators[] = {"+-*/", "+-*+"};
+    for (int kind = 0; kind < 2; kind++) {
+        for (int s = 0; s < 4; s++) {
+            int length = 0;
+            for (int i = 0; i < sizes[s]; i++) {
+                if (i > 0)
+                    expression[length++] = operators[kind][i % 4];
+                if (i % 8 == 1)
+                    expression[length++] = '(';
+                length += sprintf(expression + length, kind == 0 ? "%d.5" : "%d", 1 + i % 9);
+                if (i % 8 == 4 || (i % 8 > 1 && i % 8 < 4 && i == sizes[s] - 1))
+                    expression[length++] = ')';
+            }
+            expression[length] = '\0';
+            char name[64];
+            sprintf(name, "Calc/%s/%d_terms", kind == 0 ? "float" : "integer", sizes[s]);
+            measure(name, calc_op, expression);
+        }
+    }
+}
+
+// calc column mode end to end: rows read from a file, evaluated and formatted,
+// x*2 is exact so the results keep the shape of the input numbers
+void bench_calc_columns() {
+    const int n = 1000000;
+    const char *kinds[] = {"short_decimals", "full_precision_doubles", "integers"};
+    char *buff = malloc((size_t)n * 32);
+    char path[] = "/tmp/microshell_bench_XXXXXX";
+    int fd = mkstemp(path);
+    char *argv[] = {"calc", "-x", "x*2", path, NULL};
+    for (int kind = 0; kind < 3; kind++) {
+        size_t length = generate_numbers(buff, n, kind);
+        if (ftruncate(fd, 0) == -1 || pwrite(fd, buff, length, 0) != (ssize_t)length) {
+            fprintf(stderr, "calc columns: %s\n", strerror(errno));
+            break;
+        }
+
+        // every formatted result must read back as the same double
+        int mismatches = 0;
+        for (char *p = buff; p < buff + length; p++) {
+            double value = strtod(p, &p) * 2;
+            char text[64];
+            text[calc_format(value, text)] = '\0';
+            if (strtod(text, NULL) != value && mismatches++ < 5)
+                fprintf(stderr, "mismatch: %.17g formatted as %s\n", value, text);
+        }
+        if (mismatches > 0)
+            fprintf(stderr, "calc_format %s: %d values don't round trip\n", kinds[kind], mismatches);
+
+        FILE *saved = stdout;
+        stdout = fopen("/dev/null", "w");
+        uint64_t allocations = bench_allocations;
+        double start = now_seconds();
+        calc_columns(4, argv);
+        double elapsed = now_seconds() - start;
+        fclose(stdout);
+        stdout = saved;
+
+        char name[64], extra[64];
+        sprintf(name, "CalcColumns/%s", kinds[kind]);
+        sprintf(extra, "%.1f MB/s", length / elapsed / 1e6);
+        report(name, n, elapsed, bench_allocations - allocations, extra);
+    }
+    close(fd);
+    unlink(path);
+    free(buff);
+}
+
+void ps_op(void *data) {
+    cmd_ps();
+}
+
+void bench_ps() {
+    measure("Ps", ps_op, NULL);
+}
+
+// a keystroke at the end of the line, the two lines differ in the last character
+struct FrameCase {
+    char lines[2][1000];
+    int length;
+    int frame;
+};
+
+void print_buffer_op(void *data) {
+    struct FrameCase *c = data;
+    print_buffer(c->lines[c->frame++ & 1], c->length);
+}
+
+void bench_print_buffer() {
+    const int lengths[] = {8, 80, 400, 990};
+    // a realistic mix of a command, flags, quotes and paths
+    const char *words[] = {"grep", "-rn", "\"needle\"", "src/shell/", "'it''s'", "--color=auto"};
+    static struct FrameCase c;
+    get_prompt(); // cwd and git segments are computed once per directory
+    init_cursor_control(); // as read_input does
+    for (int l = 0; l < 4; l++) {
+        c.length = lengths[l];
+        int length = 0;
+        for (int i = 0; length < c.length; i++)
+            length += snprintf(c.lines[0] + length, c.length - length + 1, "%s ", words[i % 6]);
+        c.lines[0][c.length] = '\0';
+        strcpy(c.lines[1], c.lines[0]);
+        c.lines[1][c.length - 1] = 'x';
+        char name[64];
+        sprintf(name, "PrintBuffer/%d_chars", c.length);
+        measure(name, print_buffer_op, &c);
+    }
+    end_cursor_control();
+}
+
+void spawn_op(void *data) {
+    char **args = data;
+    struct CommandStats stats;
+    execute_command(args[0], args, 1, &stats);
+}
+
+// fork, exec of `true` found in PATH and the wait on its pidfd
+void bench_execute_command() {
+    char *args[] = {"true", NULL};
+    measure("ExecuteCommand/true", spawn_op, args);
+}
+
+// requests per second through a --serve pool, over one connection and with
+// a connection per request, against starting `microshell.e -c` for each command
+void bench_serve() {
+    const char *path = "/tmp/microshell_bench.sock";
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    pid_t server = fork();
+    if (server == 0) {
+        dup2(null, STDERR_FILENO);
+        exit(serve(path, SERVE_WORKERS));
+    }
+    int fd = -1;
+    for (int tries = 0; fd == -1 && tries < 200; tries++) {
+        usleep(10000);
+        fd = client_connect(path);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "serve: can't connect to %s\n", path);
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        return;
+    }
+    if (access("./microshell.e", X_OK) == -1)
+        fprintf(stderr, "serve: ./microshell.e not found, `make` it to compare with microshell -c\n");
+    // builtin, external and a builtin reading /proc while processes come and go
+    const char *lines[] = {"echo hello", "printf hello", "ps"};
+    const char *cases[] = {"builtin", "external", "ps"};
+    const int counts[] = {20000, 2000, 500};
+    // a request without a status means the worker died serving it
+    int broken = 0;
+    for (int l = 0; l < 3; l++) {
+        const int n = counts[l];
+        char name[64], extra[64];
+        uint64_t allocations = bench_allocations;
+        double start = now_seconds();
+        for (int i = 0; i < n; i++) {
+            if (client_request(fd, NULL, NULL, 0, lines[l], null, null) == -1) {
+                broken++;
+                close(fd);
+                fd = client_connect(path);
+            }
+        }
+        double elapsed = now_seconds() - start;
+        sprintf(name, "Serve/%s/one_connection", cases[l]);
+        sprintf(extra, "%.0f req/s", n / elapsed);
+        report(name, n, elapsed, bench_allocations - allocations, extra);
+
+        allocations = bench_allocations;
+        start = now_seconds();
+        for (int i = 0; i < n; i++) {
+            int connection = client_connect(path);
+            if (client_request(connection, NULL, NULL, 0, lines[l], null, null) == -1)
+                broken++;
+            close(connection);
+        }
+        elapsed = now_seconds() - start;
+        sprintf(name, "Serve/%s/connection_per_request", cases[l]);
+        sprintf(extra, "%.0f req/s", n / elapsed);
+        report(name, n, elapsed, bench_allocations - allocations, extra);
+
+        // a fresh shell per command, like the automation does without the server
+        const int spawns = 500;
+        allocations = bench_allocations;
+        start = now_seconds();
+        for (int i = 0; i < spawns; i++) {
+            pid_t id = fork();
+            if (id == 0) {
+                dup2(null, STDOUT_FILENO);
+                dup2(null, STDERR_FILENO);
+                execl("./microshell.e", "microshell.e", "-c", lines[l], NULL);
+                _exit(127);
+            }
+            waitpid(id, NULL, 0);
+        }
+        elapsed = now_seconds() - start;
+        sprintf(name, "Serve/%s/microshell_c", cases[l]);
+        sprintf(extra, "%.0f req/s", spawns / elapsed);
+        report(name, spawns, elapsed, bench_allocations - allocations, extra);
+    }
+    if (broken > 0)
+        fprintf(stderr, "serve: %d requests got no status, their worker died\n", broken);
+    close(fd);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    close(null);
+}
+
+int main() {
+    // the shell always runs with its event loop, execute_command waits in it
+    event_loop_init();
+    bench_parse_number();
+    bench_z_query();
+    bench_parse_arguments();
+    bench_calc();
+    bench_calc_columns();
+    bench_ps();
+    bench_print_buffer();
+    bench_execute_command();
+    bench_serve();
+    return 0;
+}
@@ -0,0 +1,774 @@
+// End to end keystroke latency of the interactive path, built with `make replay`.
+// replay.e starts microshell.e under a pseudo-terminal, sends the keys of a
+// script on a fixed schedule and times every key until the first byte of the
+// shell's redraw. The output also drives a small terminal emulator, the
+// screen left at the end is compared with the snapshot next to the script.
+//
+//   replay.e [-s shell] [-r keys/s] [-u] script.keys...   -u writes the snapshots
+//   replay.e -R script.keys [-s shell]                    records what you type
+//
+// Scripts have one command per line, # starts a comment:
+//   rate 20        keys per second of the commands that follow
+//   type ls -la    the rest of the line, one key at a time
+//   paste text     the rest of the line in a single write, like a terminal paste
+//   key up [n]     a named key n times: enter tab backspace delete up down left
+//                  right home end escape ctrl-a .. ctrl-z
+//   wait 500       pause in milliseconds
+//   send \e[A      raw bytes, escapes \e \r \n \t \\ \xHH
+//
+// The shell runs in / with HOME in a temporary directory, so that the prompt
+// and the snapshots don't depend on who runs it.
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCREEN_ROWS 24
+#define SCREEN_COLS 80
+#define QUIET_TIME 0.3 // seconds without output after which the shell is idle
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Terminal emulator, just what microshell prints: UTF-8 text, \r \n \b \t,
+// cursor movement, erasing, the alternate screen and deferred wrapping at
+// the right margin like xterm. Colors and other attributes are dropped.
+struct Screen {
+    char cells[SCREEN_ROWS][SCREEN_COLS][5]; // one UTF-8 character each
+    int row, col;
+    bool wrap_pending; // the last column was written, the next character wraps
+};
+
+struct Screen screens[2]; // main and alternate
+int active_screen = 0;
+int saved_row, saved_col;
+enum { GROUND, ESCAPE, CSI } parser_state = GROUND;
+char csi_params[32];
+int csi_length;
+
+void clear_cells(struct Screen *screen, int row, int from, int to) {
+    for (int col = from; col < to; col++)
+        strcpy(screen->cells[row][col], " ");
+}
+
+void clear_screen(struct Screen *screen) {
+    for (int row = 0; row < SCREEN_ROWS; row++)
+        clear_cells(screen, row, 0, SCREEN_COLS);
+}
+
+void line_feed(struct Screen *screen) {
+    if (screen->row < SCREEN_ROWS - 1) {
+        screen->row++;
+        return;
+    }
+    memmove(screen->cells[0], screen->cells[1], sizeof(screen->cells[0]) * (SCREEN_ROWS - 1));
+    clear_cells(screen, SCREEN_ROWS - 1, 0, SCREEN_COLS);
+}
+
+int clamp(int value, int low, int high) {
+    return value < low ? low : value > high ? high : value;
+}
+
+void csi_dispatch(struct Screen *screen, char final) {
+    csi_params[csi_length] = '\0';
+    bool private = csi_params[0] == '?';
+    int params[4] = {0};
+    int count = 0;
+    for (char *p = csi_params + private; *p != '\0' && count < 4; p++) {
+        params[count] = strtol(p, &p, 10);
+        count++;
+        if (*p != ';')
+            break;
+    }
+    int n = params[0] > 0 ? params[0] : 1;
+    if (private) {
+        if (params[0] == 1049 && (final == 'h') != (active_screen == 1)) {
+            if (final == 'h') {
+                saved_row = screen->row;
+                saved_col = screen->col;
+                active_screen = 1;
+                clear_screen(&screens[1]);
+                screens[1].row = screens[1].col = 0;
+            } else {
+                active_screen = 0;
+                screens[0].row = saved_row;
+                screens[0].col = saved_col;
+            }
+            screens[active_screen].wrap_pending = false;
+        }
+        return; // cursor visibility and others don't change the text
+    }
+    screen->wrap_pending = false;
+    switch (final) {
+        case 'A': screen->row = clamp(screen->row - n, 0, SCREEN_ROWS - 1); break;
+        case 'B': screen->row = clamp(screen->row + n, 0, SCREEN_ROWS - 1); break;
+        case 'C': screen->col = clamp(screen->col + n, 0, SCREEN_COLS - 1); break;
+        case 'D': screen->col = clamp(screen->col - n, 0, SCREEN_COLS - 1); break;
+        case 'H':
+            screen->row = clamp((params[0] > 0 ? params[0] : 1) - 1, 0, SCREEN_ROWS - 1);
+            screen->col = clamp((params[1] > 0 ? params[1] : 1) - 1, 0, SCREEN_COLS - 1);
+            break;
+        case 'K':
+            if (params[0] == 0)
+                clear_cells(screen, screen->row, screen->col, SCREEN_COLS);
+            else if (params[0] == 1)
+                clear_cells(screen, screen->row, 0, screen->col + 1);
+            else
+                clear_cells(screen, screen->row, 0, SCREEN_COLS);
+            break;
+        case 'J':
+            if (params[0] == 0) {
+                clear_cells(screen, screen->row, screen->col, SCREEN_COLS);
+                for (int row = screen->row + 1; row < SCREEN_ROWS; row++)
+                    clear_cells(screen, row, 0, SCREEN_COLS);
+            } else if (params[0] >= 2)
+                clear_screen(screen);
+            break;
+    }
+}
+
+void emulate(const char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        struct Screen *screen = &screens[active_screen];
+        unsigned char c = data[i];
+        if (parser_state == ESCAPE) {
+            parser_state = GROUND;
+            if (c == '[') {
+                parser_state = CSI;
+                csi_length = 0;
+            } else if (c == '7') {
+                saved_row = screen->row;
+                saved_col = screen->col;
+            } else if (c == '8') {
+                screen->row = saved_row;
+                screen->col = saved_col;
+            }
+        } else if (parser_state == CSI) {
+            if (c >= 0x40 && c <= 0x7E) {
+                parser_state = GROUND;
+                csi_dispatch(screen, c);
+            } else if (csi_length < sizeof(csi_params) - 1)
+                csi_params[csi_length++] = c;
+        } else if (c == 27)
+            parser_state = ESCAPE;
+        else if (c == '\r') {
+            screen->col = 0;
+            screen->wrap_pending = false;
+        } else if (c == '\n') {
+            line_feed(screen);
+            screen->wrap_pending = false;
+        } else if (c == '\b') {
+            if (screen->col > 0)
+                screen->col--;
+            screen->wrap_pending = false;
+        } else if (c == '\t') {
+            screen->col = clamp((screen->col / 8 + 1) * 8, 0, SCREEN_COLS - 1);
+        } else if ((c & 0xC0) == 0x80) {
+            // continuation byte of the character written last
+            int col = screen->wrap_pending ? screen->col : screen->col - 1;
+            char *cell = screen->cells[screen->row][clamp(col, 0, SCREEN_COLS - 1)];
+            size_t length = strlen(cell);
+            if (length < 4) {
+                cell[length] = c;
+                cell[length + 1] = '\0';
+            }
+        } else if (c >= 32 && c != 127) {
+            if (screen->wrap_pending) {
+                screen->col = 0;
+                line_feed(screen);
+                screen->wrap_pending = false;
+            }
+            char *cell = screen->cells[screen->row][screen->col];
+            cell[0] = c;
+            cell[1] = '\0';
+            if (screen->col == SCREEN_COLS - 1)
+                screen->wrap_pending = true;
+            else
+                screen->col++;
+        }
+    }
+}
+
+// rows without trailing spaces, then the cursor position
+char *screen_text() {
+    static char text[SCREEN_ROWS * (SCREEN_COLS * 4 + 1) + 64];
+    struct Screen *screen = &screens[active_screen];
+    int length = 0;
+    for (int row = 0; row < SCREEN_ROWS; row++) {
+        int line_start = length;
+        int last = length; // end of the last non space character
+        for (int col = 0; col < SCREEN_COLS; col++) {
+            length += sprintf(text + length, "%s", screen->cells[row][col]);
+            if (strcmp(screen->cells[row][col], " ") != 0)
+                last = length;
+        }
+        length = last > line_start ? last : line_start;
+        text[length++] = '\n';
+    }
+    sprintf(text + length, "cursor %d %d\n", screen->row + 1, screen->col + 1);
+    return text;
+}
+
+// Scripts are turned into events, each one write to the terminal
+enum Category { TYPING, EDIT, ENTER, PASTE, CATEGORY_COUNT };
+const char *category_names[] = {"typing", "edit", "enter", "paste"};
+
+struct Event {
+    char bytes[4096];
+    int length;
+    enum Category category;
+    double delay; // seconds since the previous event
+    double latency; // until the first byte of output, -1 if none came before the next event
+    long output; // bytes of output until the next event
+};
+
+struct Event *events;
+int event_count, event_capacity;
+
+struct Event *add_event(enum Category category, double delay) {
+    if (event_count == event_capacity) {
+        event_capacity = event_capacity == 0 ? 256 : event_capacity * 2;
+        events = realloc(events, event_capacity * sizeof(struct Event));
+    }
+    struct Event *event = &events[event_count++];
+    memset(event, 0, sizeof(*event));
+    event->category = category;
+    event->delay = delay;
+    event->latency = -1;
+    return event;
+}
+
+struct NamedKey {
+    const char *name;
+    const char *bytes;
+};
+
+const struct NamedKey named_keys[] = {
+    {"enter", "\r"}, {"tab", "\t"}, {"backspace", "\x7f"}, {"delete", "\e[3~"},
+    {"up", "\e[A"}, {"down", "\e[B"}, {"right", "\e[C"}, {"left", "\e[D"},
+    {"home", "\e[H"}, {"end", "\e[F"}, {"escape", "\e"}, {NULL, NULL},
+};
+
+// C like escapes of send, returns the length of the result
+int unescape(const char *text, char *out, int capacity) {
+    int length = 0;
+    for (const char *p = text; *p != '\0' && length < capacity; p++) {
+        if (*p != '\\' || p[1] == '\0') {
+            out[length++] = *p;
+            continue;
+        }
+        p++;
+        switch (*p) {
+            case 'e': out[length++] = 27; break;
+            case 'r': out[length++] = '\r'; break;
+            case 'n': out[length++] = '\n'; break;
+            case 't': out[length++] = '\t'; break;
+            case 'x': {
+                char hex[3] = {0};
+                for (int i = 0; i < 2 && isxdigit(p[1]); i++)
+                    hex[i] = *++p;
+                out[length++] = strtol(hex, NULL, 16);
+                break;
+            }
+            default: out[length++] = *p;
+        }
+    }
+    return length;
+}
+
+// rate overrides the rate commands of the script when above 0
+bool load_script(const char *path, double rate) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    event_count = 0;
+    double interval = rate > 0 ? 1 / rate : 0.05;
+    double pending_wait = 0; // of wait commands, added to the next event
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    int number = 0;
+    bool ok = true;
+    while ((length = getline(&line, &size, file)) != -1) {
+        number++;
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        char command[16] = {0};
+        int skip = 0;
+        if (sscanf(line, " %15s%n", command, &skip) != 1 || command[0] == '#')
+            continue;
+        const char *rest = line + skip + (line[skip] == ' ');
+        if (strcmp(command, "rate") == 0) {
+            if (rate <= 0 && atof(rest) > 0)
+                interval = 1 / atof(rest);
+        } else if (strcmp(command, "wait") == 0) {
+            pending_wait += atof(rest) / 1000;
+        } else if (strcmp(command, "type") == 0) {
+            for (const char *c = rest; *c != '\0'; c++) {
+                struct Event *event = add_event(TYPING, interval + pending_wait);
+                event->bytes[0] = *c;
+                event->length = 1;
+                pending_wait = 0;
+            }
+        } else if (strcmp(command, "paste") == 0 || strcmp(command, "send") == 0) {
+            bool paste = command[0] == 'p';
+            struct Event *event = add_event(paste ? PASTE : EDIT, interval + pending_wait);
+            event->length = paste ? snprintf(event->bytes, sizeof(event->bytes), "%s", rest)
+                                  : unescape(rest, event->bytes, sizeof(event->bytes));
+            pending_wait = 0;
+        } else if (strcmp(command, "key") == 0) {
+            char name[32] = {0};
+            int times = 1;
+            sscanf(rest, "%31s %d", name, &times);
+            const char *bytes = NULL;
+            char control[2] = {0};
+            for (int i = 0; named_keys[i].name != NULL; i++) {
+                if (strcmp(named_keys[i].name, name) == 0)
+                    bytes = named_keys[i].bytes;
+            }
+            if (strncmp(name, "ctrl-", 5) == 0 && isalpha(name[5]) && name[6] == '\0') {
+                control[0] = tolower(name[5]) & 0x1F;
+                bytes = control;
+            }
+            if (bytes == NULL) {
+                fprintf(stderr, "%s:%d: unknown key %s\n", path, number, name);
+                ok = false;
+                continue;
+            }
+            for (int i = 0; i < times; i++) {
+                struct Event *event = add_event(strcmp(name, "enter") == 0 ? ENTER : EDIT, interval + pending_wait);
+                event->length = strlen(bytes);
+                memcpy(event->bytes, bytes, event->length);
+                pending_wait = 0;
+            }
+        } else {
+            fprintf(stderr, "%s:%d: unknown command %s\n", path, number, command);
+            ok = false;
+        }
+    }
+    free(line);
+    fclose(file);
+    return ok;
+}
+
+// starts the shell on a new pseudo-terminal, returns the master side
+int spawn_shell(const char *shell, const char *home, pid_t *pid) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+        return -1;
+    struct winsize size = {.ws_row = SCREEN_ROWS, .ws_col = SCREEN_COLS};
+    ioctl(master, TIOCSWINSZ, &size);
+    const char *slave_name = ptsname(master);
+    *pid = fork();
+    if (*pid == 0) {
+        setsid();
+        int slave = open(slave_name, O_RDWR); // becomes the controlling terminal
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        if (slave > STDERR_FILENO)
+            close(slave);
+        if (home != NULL) {
+            setenv("HOME", home, 1);
+            chdir("/");
+        }
+        setenv("TERM", "xterm-256color", 1);
+        execl(shell, shell, NULL);
+        fprintf(stderr, "%s: %s\n", shell, strerror(errno));
+        _exit(127);
+    }
+    return master;
+}
+
+// reads output until deadline (or QUIET_TIME without output when quiet),
+// it belongs to event, which may be NULL. Returns false once the shell is gone.
+bool read_output(int master, struct Event *event, double sent, double deadline, bool quiet) {
+    char block[65536];
+    double last_output = now_seconds();
+    while (true) {
+        double now = now_seconds();
+        double until = quiet ? last_output + QUIET_TIME : deadline;
+        if (quiet && deadline < until)
+            until = deadline;
+        if (now >= until)
+            return true;
+        struct pollfd source = {master, POLLIN, 0};
+        int timeout = (until - now) * 1000 + 1;
+        if (poll(&source, 1, timeout) <= 0)
+            continue;
+        ssize_t n = read(master, block, sizeof(block));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false; // EIO once the shell exited
+        now = now_seconds();
+        last_output = now;
+        emulate(block, n);
+        if (event != NULL) {
+            if (event->latency < 0)
+                event->latency = now - sent;
+            event->output += n;
+        }
+    }
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank
+double percentile(const double *sorted, int n, double p) {
+    int rank = p * n + 0.999999;
+    return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+void print_report() {
+    double *latencies = malloc((event_count + 1) * sizeof(double));
+    for (int category = 0; category < CATEGORY_COUNT; category++) {
+        int keys = 0, measured = 0;
+        long output = 0;
+        for (int i = 0; i < event_count; i++) {
+            if (events[i].category != category)
+                continue;
+            keys++;
+            output += events[i].output;
+            if (events[i].latency >= 0)
+                latencies[measured++] = events[i].latency * 1e3;
+        }
+        if (keys == 0)
+            continue;
+        printf("  %-7s %5d keys", category_names[category], keys);
+        if (measured > 0) {
+            qsort(latencies, measured, sizeof(double), compare_doubles);
+            printf("  p50 %7.2f ms  p90 %7.2f ms  p99 %7.2f ms  max %7.2f ms",
+                    percentile(latencies, measured, 0.5), percentile(latencies, measured, 0.9),
+                    percentile(latencies, measured, 0.99), latencies[measured - 1]);
+        }
+        // keys sent before the shell answered the previous one are drawn together
+        printf("  %8.1f bytes/key  %d coalesced\n", (double)output / keys, keys - measured);
+    }
+    free(latencies);
+}
+
+void remove_directory(const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    char file[4096];
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            unlink(file);
+        }
+    }
+    if (dir != NULL)
+        closedir(dir);
+    rmdir(path);
+}
+
+// returns false if the screen doesn't match the snapshot
+bool replay(const char *script, const char *shell, double rate, bool update) {
+    if (!load_script(script, rate))
+        return false;
+    char home[] = "/tmp/microshell_replay.XXXXXX";
+    if (mkdtemp(home) == NULL) {
+        fprintf(stderr, "mkdtemp: %s\n", strerror(errno));
+        return false;
+    }
+    memset(screens, 0, sizeof(screens));
+    clear_screen(&screens[0]);
+    active_screen = 0;
+    parser_state = GROUND;
+
+    pid_t pid;
+    int master = spawn_shell(shell, home, &pid);
+    if (master == -1) {
+        fprintf(stderr, "pty: %s\n", strerror(errno));
+        remove_directory(home);
+        return false;
+    }
+    // the first prompt is drawn again when the git segment arrives
+    bool alive = read_output(master, NULL, 0, now_seconds() + 5, true);
+    // events go out on a fixed schedule, a slow shell doesn't slow the typing,
+    // output until the next one is due belongs to the event sent last
+    double next = now_seconds();
+    double sent = 0;
+    for (int i = 0; i < event_count && alive; i++) {
+        next += events[i].delay;
+        alive = read_output(master, i > 0 ? &events[i - 1] : NULL, sent, next, false);
+        sent = now_seconds();
+        if (write(master, events[i].bytes, events[i].length) != events[i].length)
+            alive = false;
+    }
+    if (alive && event_count > 0)
+        read_output(master, &events[event_count - 1], sent, sent + 30, true);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(master);
+    remove_directory(home);
+
+    printf("%s\n", script);
+    print_report();
+
+    char snapshot[4096];
+    snprintf(snapshot, sizeof(snapshot), "%.*s.screen",
+            (int)(strrchr(script, '.') > strrchr(script, '/') ? strrchr(script, '.') - script : strlen(script)), script);
+    const char *text = screen_text();
+    if (update) {
+        FILE *file = fopen(snapshot, "w");
+        if (file == NULL) {
+            fprintf(stderr, "%s: %s\n", snapshot, strerror(errno));
+            return false;
+        }
+        fputs(text, file);
+        fclose(file);
+        printf("  screen written to %s\n", snapshot);
+        return true;
+    }
+    FILE *file = fopen(snapshot, "r");
+    if (file == NULL) {
+        printf("  no snapshot %s, -u writes it\n", snapshot);
+        return true;
+    }
+    static char expected[sizeof(((struct Screen *)0)->cells) + 64];
+    size_t size = fread(expected, 1, sizeof(expected) - 1, file);
+    expected[size] = '\0';
+    fclose(file);
+    if (strcmp(expected, text) == 0) {
+        printf("  screen matches %s\n", snapshot);
+        return true;
+    }
+    // line by line, the expected one first
+    printf("  screen differs from %s\n", snapshot);
+    const char *a = expected, *b = text;
+    for (int line = 1; *a != '\0' || *b != '\0'; line++) {
+        int a_length = strchrnul(a, '\n') - a, b_length = strchrnul(b, '\n') - b;
+        if (a_length != b_length || memcmp(a, b, a_length) != 0)
+            printf("  %3d - %.*s\n  %3d + %.*s\n", line, a_length, a, line, b_length, b);
+        a += a_length + (a[a_length] == '\n');
+        b += b_length + (b[b_length] == '\n');
+    }
+    return false;
+}
+
+// Recording: the shell runs like in a replay, what is typed goes to it with
+// the time it was read. A read of a single key is typing or a named key, a
+// longer one a paste, pauses of a second or more become wait commands.
+struct Input {
+    char bytes[256];
+    int length;
+    double time;
+};
+
+// bytes as the send command reads them
+void write_escaped(FILE *file, const char *bytes, int length) {
+    for (int i = 0; i < length; i++) {
+        unsigned char c = bytes[i];
+        if (c == 27)
+            fputs("\\e", file);
+        else if (c == '\r')
+            fputs("\\r", file);
+        else if (c == '\n')
+            fputs("\\n", file);
+        else if (c == '\t')
+            fputs("\\t", file);
+        else if (c == '\\')
+            fputs("\\\\", file);
+        else if (c < 32 || c == 127)
+            fprintf(file, "\\x%02x", c);
+        else
+            fputc(c, file);
+    }
+}
+
+const char *key_name(const char *bytes, int length) {
+    static char control[8];
+    for (int i = 0; named_keys[i].name != NULL; i++) {
+        if ((int)strlen(named_keys[i].bytes) == length && memcmp(named_keys[i].bytes, bytes, length) == 0)
+            return named_keys[i].name;
+    }
+    if (length == 1 && bytes[0] >= 1 && bytes[0] <= 26) {
+        sprintf(control, "ctrl-%c", 'a' + bytes[0] - 1);
+        return control;
+    }
+    return NULL;
+}
+
+void write_script(FILE *file, struct Input *inputs, int count) {
+    // the typing rate is the median gap between typed keys
+    double *gaps = malloc((count + 1) * sizeof(double));
+    int gap_count = 0;
+    for (int i = 1; i < count; i++) {
+        double gap = inputs[i].time - inputs[i - 1].time;
+        if (inputs[i].length == 1 && isprint(inputs[i].bytes[0]) && gap < 1)
+            gaps[gap_count++] = gap;
+    }
+    qsort(gaps, gap_count, sizeof(double), compare_doubles);
+    double interval = gap_count > 0 && gaps[gap_count / 2] > 0.001 ? gaps[gap_count / 2] : 0.05;
+    free(gaps);
+    fprintf(file, "# recorded with replay.e -R\nrate %.0f\n", 1 / interval);
+
+    bool typing = false;
+    for (int i = 0; i < count; i++) {
+        struct Input *input = &inputs[i];
+        double gap = i > 0 ? input->time - inputs[i - 1].time : 0;
+        bool typed = input->length == 1 && isprint(input->bytes[0]);
+        if (typing && (!typed || gap >= 1)) {
+            fputc('\n', file);
+            typing = false;
+        }
+        if (gap >= 1)
+            fprintf(file, "wait %.0f\n", (gap - interval) * 1000);
+        const char *name = key_name(input->bytes, input->length);
+        if (typed) {
+            if (!typing)
+                fputs("type ", file);
+            fputc(input->bytes[0], file);
+            typing = true;
+        } else if (name != NULL) {
+            // repeats of a key with no pause make one command
+            int times = 1;
+            while (i + times < count && inputs[i + times].length == input->length &&
+                    memcmp(inputs[i + times].bytes, input->bytes, input->length) == 0 &&
+                    inputs[i + times].time - inputs[i + times - 1].time < 1)
+                times++;
+            i += times - 1;
+            fprintf(file, times > 1 ? "key %s %d\n" : "key %s\n", name, times);
+        } else {
+            bool printable = true;
+            for (int j = 0; j < input->length; j++)
+                printable = printable && ((unsigned char)input->bytes[j] >= 32 && input->bytes[j] != 127);
+            fputs(printable ? "paste " : "send ", file);
+            if (printable)
+                fwrite(input->bytes, 1, input->length, file);
+            else
+                write_escaped(file, input->bytes, input->length);
+            fputc('\n', file);
+        }
+    }
+    if (typing)
+        fputc('\n', file);
+}
+
+int record(const char *path, const char *shell) {
+    if (!isatty(STDIN_FILENO)) {
+        fprintf(stderr, "recording needs a terminal\n");
+        return 1;
+    }
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    char home[] = "/tmp/microshell_replay.XXXXXX";
+    pid_t pid;
+    int master = mkdtemp(home) == NULL ? -1 : spawn_shell(shell, home, &pid);
+    if (master == -1) {
+        fprintf(stderr, "pty: %s\n", strerror(errno));
+        fclose(file);
+        return 1;
+    }
+    fprintf(stderr, "recording into %s on a %dx%d terminal, exit the shell to stop\r\n", path, SCREEN_COLS, SCREEN_ROWS);
+    struct termios saved, raw;
+    tcgetattr(STDIN_FILENO, &saved);
+    raw = saved;
+    cfmakeraw(&raw);
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    struct Input *inputs = NULL;
+    int count = 0, capacity = 0;
+    char block[65536];
+    struct pollfd sources[2] = {{STDIN_FILENO, POLLIN, 0}, {master, POLLIN, 0}};
+    while (true) {
+        if (poll(sources, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (sources[1].revents != 0) {
+            ssize_t n = read(master, block, sizeof(block));
+            if (n <= 0)
+                break; // the shell exited
+            write(STDOUT_FILENO, block, n);
+        }
+        if (sources[0].revents != 0) {
+            if (count == capacity) {
+                capacity = capacity == 0 ? 256 : capacity * 2;
+                inputs = realloc(inputs, capacity * sizeof(struct Input));
+            }
+            struct Input *input = &inputs[count];
+            input->length = read(STDIN_FILENO, input->bytes, sizeof(input->bytes));
+            input->time = now_seconds();
+            if (input->length <= 0)
+                break;
+            write(master, input->bytes, input->length);
+            count++;
+        }
+    }
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(master);
+    remove_directory(home);
+
+    write_script(file, inputs, count);
+    fclose(file);
+    free(inputs);
+    fprintf(stderr, "%d inputs written to %s\n", count, path);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *shell = "./microshell.e";
+    const char *record_path = NULL;
+    double rate = 0;
+    bool update = false;
+    int option;
+    while ((option = getopt(argc, argv, "s:r:uR:")) != -1) {
+        switch (option) {
+            case 's': shell = optarg; break;
+            case 'r': rate = atof(optarg); break;
+            case 'u': update = true; break;
+            case 'R': record_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-s shell] [-r keys/s] [-u] script.keys... | -R script.keys\n", argv[0]);
+                return 2;
+        }
+    }
+    // the shell starts in /, a relative path wouldn't be found there
+    char shell_path[4096];
+    if (realpath(shell, shell_path) == NULL) {
+        fprintf(stderr, "%s: %s\n", shell, strerror(errno));
+        return 2;
+    }
+    shell = shell_path;
+    if (record_path != NULL)
+        return record(record_path, shell);
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-s shell] [-r keys/s] [-u] script.keys... | -R script.keys\n", argv[0]);
+        return 2;
+    }
+    int failures = 0;
+    for (int i = optind; i < argc; i++) {
+        if (!replay(argv[i], shell, rate, update))
+            failures++;
+    }
+    return failures > 0;
+}
@@ -1,19 +1,42 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <termios.h>
 #include <locale.h>
 #include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include "powers_of_five.h"
 
 #define ESC 27
 #define ARROW_UP 65
@@ -37,6 +60,7 @@
 #define BOLD "\e[1m"
 #define ITALIC "\e[3m"
 #define UNDERLINE "\e[4m"
+#define REVERSE "\e[7m"
 
 // foreground - \e[38;2;r;g;b
 #define FG_RED "\e[38;2;255;0;0m"
@@ -55,6 +79,8 @@
 #define C_PATH "\e[38;2;108;129;151m"
 // #ECC667
 #define C_PROMPT "\e[38;2;236;198;103m"
+// #B39DDB
+#define C_GIT "\e[38;2;179;157;219m"
 
 // ps command
 // #B4F8C8
@@ -91,10 +117,189 @@ const int max_word_count = 100;
 const int max_word_length = 1000; // including null terminator
 const int user_buffer_size = 1000;
 
-int get_terminal_width() {
+// The shell waits for everything in one epoll loop: stdin while the line editor
+// is active, signals through a signalfd, the foreground child through a pidfd,
+// the git job's pipe and timers. A source is a file descriptor with a handler
+// which runs on the shell's only thread, so async features need no locks.
+#define MAX_EVENT_SOURCES 32
+
+typedef void (*EventHandler)(int fd, void *data);
+
+struct EventSource {
+    bool used;
+    int fd;
+    EventHandler handler;
+    void *data;
+};
+
+int event_fd = -1; // epoll instance, -1 until event_loop_init
+struct EventSource event_sources[MAX_EVENT_SOURCES];
+int signal_fd = -1;
+sigset_t original_signal_mask; // restored in children
+
+bool event_add(int fd, EventHandler handler, void *data) {
+    if (event_fd == -1)
+        return false;
+    for (int i = 0; i < MAX_EVENT_SOURCES; i++) {
+        if (event_sources[i].used)
+            continue;
+        // slot and fd, so that an event of a source removed meanwhile is skipped
+        struct epoll_event event = {.events = EPOLLIN, .data.u64 = (uint64_t)fd << 32 | i};
+        if (epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+            return false;
+        event_sources[i] = (struct EventSource){true, fd, handler, data};
+        return true;
+    }
+    return false;
+}
+
+void event_remove(int fd) {
+    for (int i = 0; i < MAX_EVENT_SOURCES; i++) {
+        if (event_sources[i].used && event_sources[i].fd == fd) {
+            epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL);
+            event_sources[i].used = false;
+        }
+    }
+}
+
+// waits up to timeout milliseconds (-1 forever) and runs handlers of ready sources
+void event_run_once(int timeout) {
+    struct epoll_event events[16];
+    int n = epoll_wait(event_fd, events, 16, timeout);
+    for (int i = 0; i < n; i++) {
+        struct EventSource *source = &event_sources[events[i].data.u64 & 0xFFFFFFFF];
+        if (source->used && source->fd == (int)(events[i].data.u64 >> 32))
+            source->handler(source->fd, source->data);
+    }
+}
+
+// handlers of timers call read_timer, returns number of expirations
+uint64_t read_timer(int fd) {
+    uint64_t expirations = 0;
+    read(fd, &expirations, sizeof(expirations));
+    return expirations;
+}
+
+// returns fd of the timer for event_remove_timer, -1 on failure
+int event_add_timer(double seconds, bool repeat, EventHandler handler, void *data) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd == -1)
+        return -1;
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = (time_t)seconds;
+    spec.it_value.tv_nsec = (seconds - (time_t)seconds) * 1e9;
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+        spec.it_value.tv_nsec = 1; // zero would disarm it
+    if (repeat)
+        spec.it_interval = spec.it_value;
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1 || !event_add(fd, handler, data)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void event_remove_timer(int fd) {
+    if (fd == -1)
+        return;
+    event_remove(fd);
+    close(fd);
+}
+
+// terminal size is cached while SIGWINCH is delivered through the loop
+int terminal_width = 0, terminal_height = 0; // 0 - unknown
+bool terminal_resized = false;
+
+void query_terminal_size() {
     struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    return w.ws_col;
+    bool ok = ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0;
+    // 80x24 when stdout isn't a terminal
+    terminal_width = ok && w.ws_col > 0 ? w.ws_col : 80;
+    terminal_height = ok && w.ws_row > 0 ? w.ws_row : 24;
+}
+
+int get_terminal_width() {
+    if (terminal_width == 0 || signal_fd == -1)
+        query_terminal_size();
+    return terminal_width;
+}
+
+int get_terminal_height() {
+    if (terminal_height == 0 || signal_fd == -1)
+        query_terminal_size();
+    return terminal_height;
+}
+
+int relay_master = -1; // pty of a command run while recording
+
+void on_signal(int fd, void *data) {
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGWINCH) {
+            terminal_width = terminal_height = 0;
+            terminal_resized = true;
+            struct winsize w;
+            if (relay_master != -1 && ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0)
+                ioctl(relay_master, TIOCSWINSZ, &w); // the command gets its own SIGWINCH
+        }
+    }
+}
+
+// Keys are read from the terminal in bulk whenever the line editor waits, what
+// is left after a line is submitted is replayed into the next prompt. stdin
+// isn't watched while a child runs, so that keys meant for it aren't taken.
+char typeahead[4096];
+int typeahead_start = 0, typeahead_end = 0;
+bool stdin_eof = false;
+bool stdin_is_terminal = false;
+bool stdin_listening = false;
+
+// other than a terminal stdin is read a byte at a time,
+// so that commands of a script reading stdin get the rest of it
+void fill_typeahead() {
+    if (typeahead_start == typeahead_end)
+        typeahead_start = typeahead_end = 0;
+    if (typeahead_end == sizeof(typeahead)) {
+        memmove(typeahead, typeahead + typeahead_start, typeahead_end - typeahead_start);
+        typeahead_end -= typeahead_start;
+        typeahead_start = 0;
+    }
+    ssize_t r = read(STDIN_FILENO, typeahead + typeahead_end,
+                     stdin_is_terminal ? sizeof(typeahead) - typeahead_end : 1);
+    if (r > 0)
+        typeahead_end += r;
+    else if (r == 0 || (errno != EINTR && errno != EAGAIN))
+        stdin_eof = true;
+}
+
+void on_stdin(int fd, void *data) {
+    fill_typeahead();
+    if (stdin_eof)
+        event_remove(STDIN_FILENO);
+}
+
+// a regular file can't be watched, then reads just block
+void listen_stdin(bool on) {
+    if (on && !stdin_listening && !stdin_eof)
+        stdin_listening = event_add(STDIN_FILENO, on_stdin, NULL);
+    else if (!on && stdin_listening) {
+        event_remove(STDIN_FILENO);
+        stdin_listening = false;
+    }
+}
+
+void event_loop_init() {
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    stdin_is_terminal = isatty(STDIN_FILENO);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &signals, &original_signal_mask);
+    signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signal_fd != -1 && !event_add(signal_fd, on_signal, NULL)) {
+        close(signal_fd);
+        signal_fd = -1;
+    }
 }
 
 int max(int a, int b) {
@@ -105,6 +310,48 @@ int min(int a, int b) {
     return a < b ? a : b;
 }
 
+// Latency tracing, enabled by `trace on`. Spans are written into a preallocated
+// ring buffer (the oldest are overwritten), a slot is claimed with an atomic
+// increment so that recording never blocks. While tracing is off every probe
+// costs one well predicted branch on a global flag.
+#define TRACE_CAPACITY 65536 // power of two
+
+struct TraceSpan {
+    const char *name; // string literal
+    uint64_t start; // nanoseconds, CLOCK_MONOTONIC
+    uint64_t duration; // nanoseconds
+    int arg;
+    char phase; // 'X' - span, 'i' - instant
+};
+
+bool tracing = false;
+struct TraceSpan trace_ring[TRACE_CAPACITY];
+uint64_t trace_head = 0; // spans recorded since trace on
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_record(const char *name, char phase, uint64_t start, int arg) {
+    uint64_t end = trace_now();
+    uint64_t idx = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct TraceSpan *span = &trace_ring[idx & (TRACE_CAPACITY - 1)];
+    span->name = name;
+    span->start = phase == 'X' ? start : end;
+    span->duration = phase == 'X' ? end - start : 0;
+    span->arg = arg;
+    span->phase = phase;
+}
+
+// TRACE_BEGIN(span); ... TRACE_END(span, "name");
+#define TRACE_BEGIN(span) uint64_t span = __builtin_expect(tracing, 0) ? trace_now() : 0
+#define TRACE_END(span, name) \
+    do { if (__builtin_expect(span != 0, 0)) trace_record(name, 'X', span, 0); } while (0)
+#define TRACE_INSTANT(name, arg) \
+    do { if (__builtin_expect(tracing, 0)) trace_record(name, 'i', 0, arg); } while (0)
+
 bool _cursor_control = false;
 int _x = 0, _y = 0;
 char _old_buffer[100000] = {'\0'};
@@ -121,7 +368,8 @@ void end_cursor_control() {
 // adjusts x and y as if buff's contents were printed
 void buff_shift(const char * const buff, int *x, int *y) {
     int width = get_terminal_width();
-    for (int i = 0; i < _strlen(buff); i++) {
+    int length = _strlen(buff);
+    for (int i = 0; i < length; i++) {
         if (buff[i] == '\n') {
             *x = 0;
             (*y)++;
@@ -148,7 +396,8 @@ void ccprintf(const char *const format, ...) {
     va_end(args);
     int width = get_terminal_width();
     bool is_escaped = false;
-    for (int i = 0; i < strlen(buff); i++) {
+    int length = strlen(buff);
+    for (int i = 0; i < length; i++) {
         printf("%c", buff[i]);
         if (buff[i] == '\e')
             is_escaped = true;
@@ -211,11 +460,17 @@ void ccreset_cursor() {
 }
 
 // useful insight: https://en.wikibooks.org/wiki/Serial_Programming/termios
-char getchar_unbuffered() {
+// Terminal stays in this mode for the whole read_input, so that keys typed while
+// the shell waits for something else (e.g. a prompt segment) are not echoed.
+bool _raw_mode = false;
+struct termios _old_config;
+void enable_raw_mode() {
     // terminal config
     struct termios config;
-    tcgetattr(STDIN_FILENO, &config);
-    struct termios old_config = config;
+    if (tcgetattr(STDIN_FILENO, &config) == -1)
+        return; // not a terminal
+    _old_config = config;
+    _raw_mode = true;
 
     // VTIME - timeout
     config.c_cc[VTIME] = 0; // don't wait
@@ -231,16 +486,266 @@ char getchar_unbuffered() {
     config.c_iflag |= ICRNL;
 
     tcsetattr(STDIN_FILENO, TCSANOW, &config);
-    char c = getchar();
-    tcsetattr(STDIN_FILENO, TCSANOW, &old_config);
+}
+
+void disable_raw_mode() {
+    if (_raw_mode)
+        tcsetattr(STDIN_FILENO, TCSANOW, &_old_config);
+    _raw_mode = false;
+}
+
+char getchar_unbuffered() {
+    fflush(stdout); // reading with read() doesn't flush stdout like getchar() does
+    while (typeahead_start == typeahead_end) {
+        if (stdin_eof)
+            return EOF;
+        fill_typeahead();
+    }
+    char c = typeahead[typeahead_start++];
+    TRACE_INSTANT("key", c);
     return c;
 }
 
 
-char * get_prompt();
+const char *builtin_names[] = {
+    "help", "exit", "type", "calc", "cd", "ps", "args", "pushd", "popd", "dirs", "z",
+    "time", "limit", "history", "stats", "trace", "watch", "record",
+    "cat", "ls", "wc", "echo", "pwd", "true", "false", NULL
+};
+
+// returns the entry of builtin_names, NULL if name isn't a builtin
+const char *find_builtin(const char *name) {
+    for (int i = 0; builtin_names[i] != NULL; i++) {
+        if (strcmp(builtin_names[i], name) == 0)
+            return builtin_names[i];
+    }
+    return NULL;
+}
+
+bool is_builtin(const char *name) {
+    return find_builtin(name) != NULL;
+}
+
+// Results of PATH lookups, so that highlighting doesn't walk PATH on every key.
+// Direct mapped, an entry expires after a while so that newly installed programs
+// show up, and everything is dropped when PATH changes.
+#define COMMAND_CACHE_SIZE 256 // power of two
+#define COMMAND_CACHE_TTL 5.0 // seconds
+
+struct CommandCacheEntry {
+    char name[64];
+    bool exists;
+    double time;
+};
+
+struct CommandCacheEntry command_cache[COMMAND_CACHE_SIZE];
+char command_cache_path[4096] = {'\0'};
+
+double monotonic_seconds();
+
+bool is_executable(const char *path) {
+    struct stat st;
+    return access(path, X_OK) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool find_in_path(const char *name) {
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        return false;
+    while (*path != '\0') {
+        const char *end = strchrnul(path, ':');
+        char candidate[4200];
+        // an empty entry means the current directory
+        if (end == path)
+            snprintf(candidate, sizeof(candidate), "./%s", name);
+        else
+            snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)(end - path), path, name);
+        if (is_executable(candidate))
+            return true;
+        path = *end == ':' ? end + 1 : end;
+    }
+    return false;
+}
+
+bool command_exists(const char *name) {
+    if (name[0] == '\0')
+        return false;
+    if (strchr(name, '/') != NULL)
+        return is_executable(name); // relative to cwd, not worth caching
+    if (strlen(name) >= sizeof(command_cache[0].name))
+        return find_in_path(name);
+
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = "";
+    if (strcmp(path, command_cache_path) != 0) {
+        snprintf(command_cache_path, sizeof(command_cache_path), "%s", path);
+        memset(command_cache, 0, sizeof(command_cache));
+    }
+
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const char *c = name; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    struct CommandCacheEntry *entry = &command_cache[hash & (COMMAND_CACHE_SIZE - 1)];
+    double now = monotonic_seconds();
+    if (strcmp(entry->name, name) == 0 && now - entry->time < COMMAND_CACHE_TTL)
+        return entry->exists;
+    strcpy(entry->name, name);
+    entry->exists = find_in_path(name);
+    entry->time = now;
+    return entry->exists;
+}
+
+// Syntax highlighting of the line being edited. Lexer state before every
+// position is kept together with the text it was computed for, after an edit
+// only the part from the start of the edited word onward is lexed again.
+#define HIGHLIGHT_SIZE 1000 // user_buffer_size
+
+enum HighlightClass {
+    HL_PLAIN,
+    HL_BUILTIN,
+    HL_COMMAND,
+    HL_UNKNOWN,
+    HL_STRING,
+    HL_UNBALANCED,
+    HL_OPERATOR,
+    HL_VARIABLE
+};
+
+const char *highlight_colors[] = {
+    [HL_PLAIN] = "",
+    [HL_BUILTIN] = BOLD FG_GREEN,
+    [HL_COMMAND] = FG_GREEN,
+    [HL_UNKNOWN] = FG_RED,
+    [HL_STRING] = FG_YELLOW,
+    [HL_UNBALANCED] = BG_RED FG_WHITE,
+    [HL_OPERATOR] = C_GIT,
+    [HL_VARIABLE] = C_PATH,
+};
+
+struct LexState {
+    char quote; // opening quote or 0
+    short quote_start;
+    short word_start; // -1 between words
+    bool command; // current or next word is a command name
+};
+
+char hl_text[HIGHLIGHT_SIZE + 1] = {'\0'};
+int hl_length = 0;
+struct LexState hl_states[HIGHLIGHT_SIZE + 1]; // state before each character
+unsigned char hl_classes[HIGHLIGHT_SIZE];
+char hl_output[HIGHLIGHT_SIZE * 32];
+
+bool is_operator(char c) {
+    return c == '|' || c == ';' || c == '&' || c == '<' || c == '>';
+}
+
+// colors a finished command word, quotes are removed like parse_arguments does
+void highlight_command_word(const char *line, int from, int to) {
+    char name[HIGHLIGHT_SIZE + 1];
+    int length = 0;
+    for (int i = from; i < to; i++) {
+        if (line[i] != '\'' && line[i] != '"')
+            name[length++] = line[i];
+    }
+    name[length] = '\0';
+    enum HighlightClass class = HL_UNKNOWN;
+    if (is_builtin(name))
+        class = HL_BUILTIN;
+    else if (command_exists(name))
+        class = HL_COMMAND;
+    for (int i = from; i < to; i++)
+        hl_classes[i] = class;
+}
+
+void highlight_lex(const char *line, int start, int length) {
+    struct LexState st = {0, 0, -1, true};
+    if (start > 0)
+        st = hl_states[start];
+    for (int i = start; i < length; i++) {
+        hl_states[i] = st;
+        char c = line[i];
+        if (st.quote != 0) {
+            hl_classes[i] = HL_STRING;
+            if (c == st.quote)
+                st.quote = 0;
+        } else if (isspace(c) || is_operator(c)) {
+            if (st.word_start >= 0) {
+                if (st.command)
+                    highlight_command_word(line, st.word_start, i);
+                st.command = false;
+                st.word_start = -1;
+            }
+            hl_classes[i] = HL_PLAIN;
+            if (is_operator(c)) {
+                hl_classes[i] = HL_OPERATOR;
+                if (c == '|' || c == ';' || c == '&')
+                    st.command = true;
+            }
+        } else {
+            if (st.word_start < 0)
+                st.word_start = i;
+            hl_classes[i] = HL_PLAIN;
+            if (c == '\'' || c == '"') {
+                st.quote = c;
+                st.quote_start = i;
+                hl_classes[i] = HL_STRING;
+            } else if (c == '$' && line[i + 1] == '?') {
+                hl_classes[i] = hl_classes[i + 1] = HL_VARIABLE;
+                hl_states[++i] = st;
+            }
+        }
+    }
+    hl_states[length] = st;
+    // the last word and quote are still open
+    if (st.word_start >= 0 && st.command)
+        highlight_command_word(line, st.word_start, length);
+    if (st.quote != 0) {
+        for (int i = st.quote_start; i < length; i++)
+            hl_classes[i] = HL_UNBALANCED;
+    }
+}
+
+// returns line with color escape codes, valid until the next call
+const char *highlight_line(const char *line) {
+    int length = min(strlen(line), HIGHLIGHT_SIZE);
+    // lexing restarts at the word containing the first changed character
+    int start = 0;
+    while (start < length && start < hl_length && line[start] == hl_text[start])
+        start++;
+    if (start == length && length == hl_length && length > 0)
+        start = length; // unchanged
+    else {
+        if (start > 0 && hl_states[start].word_start >= 0)
+            start = hl_states[start].word_start;
+        highlight_lex(line, start, length);
+        memcpy(hl_text, line, length);
+        hl_text[length] = '\0';
+        hl_length = length;
+    }
+
+    char *out = hl_output;
+    int class = HL_PLAIN;
+    for (int i = 0; i < length; i++) {
+        if (hl_classes[i] != class) {
+            class = hl_classes[i];
+            out = stpcpy(out, RESET);
+            out = stpcpy(out, highlight_colors[class]);
+        }
+        *out++ = line[i];
+    }
+    if (class != HL_PLAIN)
+        out = stpcpy(out, RESET);
+    *out = '\0';
+    return hl_output;
+}
+
+const char *get_prompt();
+bool wait_for_key();
 void print_buffer(const char * const user_buffer, int pos) {
+    TRACE_BEGIN(span);
     // clear
-    char *prompt = get_prompt();
+    const char *prompt = get_prompt();
     ccreset_cursor();
     int old_x = 0, old_y = 0;
     buff_shift(_old_buffer, &old_x, &old_y);
@@ -255,9 +760,10 @@ void print_buffer(const char * const user_buffer, int pos) {
     ccreset_cursor();
 
     // redraw
+    const char *highlighted = highlight_line(user_buffer);
     ccprintf("%s", prompt);
-    ccprintf("%s", user_buffer);
-    sprintf(_old_buffer, "%s%s", prompt, user_buffer);
+    ccprintf("%s", highlighted);
+    sprintf(_old_buffer, "%s%s", prompt, highlighted);
 
     // move cursor to the correct position
     int width = get_terminal_width();
@@ -266,8 +772,7 @@ void print_buffer(const char * const user_buffer, int pos) {
     int y = pos / width;
     ccreset_cursor();
     ccmove_cursor(x, y);
-
-    free(prompt);
+    TRACE_END(span, "print_buffer");
 }
 
 void insert_character_at(char c, char *str, int pos) {
@@ -285,8 +790,28 @@ void remove_character_at(char *str, int pos) {
         str[i] = str[i + 1];
 }
 
-char history[200][1000];
+#define HISTORY_SIZE 200
+
+// resource usage of a finished command
+struct CommandStats {
+    int status;
+    double real; // seconds
+    double user;
+    double sys;
+    long max_rss; // kilobytes, 0 for builtins (they run inside the shell)
+    long minor_faults;
+    long major_faults;
+    long voluntary_switches;
+    long involuntary_switches;
+    int limits_hit; // LIMIT_ flags of limits the command ran into
+};
+
+char history[HISTORY_SIZE][1000];
+struct CommandStats history_stats[HISTORY_SIZE];
+bool history_has_stats[HISTORY_SIZE];
 int his_top = 0; // first free slot / length
+void record_marker(const char *line);
+
 void read_input(char * const buff, const int buff_size) {
     char c;
     int pos = 0;
@@ -295,10 +820,15 @@ void read_input(char * const buff, const int buff_size) {
     // position in history counting from the end of the array
     int his_cur = -1; // -1 - clean buffer
 
+    enable_raw_mode();
+    listen_stdin(true);
     init_cursor_control();
     print_buffer(buff, pos);
 
     do {
+        // redraw if a prompt segment changes before the next key arrives
+        while (!wait_for_key())
+            print_buffer(buff, pos);
         c = getchar_unbuffered();
         switch (c) {
             case ESC:
@@ -368,29 +898,94 @@ void read_input(char * const buff, const int buff_size) {
                 }
                 break;
         }
-        print_buffer(buff, pos);
+        // a paste or type-ahead is drawn once, after its last key
+        if (typeahead_start == typeahead_end)
+            print_buffer(buff, pos);
     } while (c != EOF && c != '\n');
     // move cursor to the end
     print_buffer(buff, length);
     end_cursor_control();
+    listen_stdin(false);
+    disable_raw_mode();
 
     // don't add empty input
-    if (length > 0)
+    if (length > 0) {
+        // drop the oldest entry when full
+        if (his_top == HISTORY_SIZE) {
+            memmove(history[0], history[1], sizeof(history[0]) * (HISTORY_SIZE - 1));
+            memmove(&history_stats[0], &history_stats[1], sizeof(history_stats[0]) * (HISTORY_SIZE - 1));
+            memmove(&history_has_stats[0], &history_has_stats[1], sizeof(history_has_stats[0]) * (HISTORY_SIZE - 1));
+            his_top--;
+        }
+        history_has_stats[his_top] = false;
         strcpy(history[his_top++], buff);
+        record_marker(buff);
+    }
+}
+
+int last_status = 0; // $?
+
+int command_substitution(const char *command, int length, char **output, size_t *size);
+
+// returns index of the ) or ` closing the substitution starting at line[i], -1 if none
+int find_substitution_end(const char *line, int i) {
+    if (line[i] == '`') {
+        const char *end = strchr(line + i + 1, '`');
+        return end == NULL ? -1 : end - line;
+    }
+    int depth = 0;
+    char quote = 0;
+    for (int j = i + 1; line[j] != '\0'; j++) {
+        if (quote != 0) {
+            if (line[j] == quote)
+                quote = 0;
+        } else if (line[j] == '\'' || line[j] == '"')
+            quote = line[j];
+        else if (line[j] == '(')
+            depth++;
+        else if (line[j] == ')' && --depth == 0)
+            return j;
+    }
+    return -1;
 }
 
 // returns number of arguments
 int parse_arguments(const char *const line, char **buff) {
+    TRACE_BEGIN(span);
     int top = 0;
     int idx = 0;
     const char no_quote = -1;
     char opening_quote = no_quote;
-    for (int i = 0; i < strlen(line); i++) {
+    const int length = strlen(line);
+    // words longer than max_word_length are truncated, ones above max_word_count dropped
+    #define APPEND(c) do { if (idx < max_word_length - 1) buff[top][idx++] = (c); } while (0)
+    #define END_WORD() do { if (idx > 0) { buff[top++][idx] = '\0'; idx = 0; } } while (0)
+    for (int i = 0; i < length && top < max_word_count - 1; i++) {
         if (opening_quote == no_quote && isspace(line[i])) {
-            if (idx > 0) {
-                buff[top++][idx] = '\0';
-                idx = 0;
+            END_WORD();
+        } else if (((line[i] == '$' && line[i + 1] == '(') || line[i] == '`') && opening_quote != '\'') {
+            int end = find_substitution_end(line, i);
+            if (end == -1) {
+                APPEND(line[i]); // unterminated, taken literally
+                continue;
+            }
+            int start = line[i] == '`' ? i + 1 : i + 2;
+            char *output;
+            size_t size;
+            command_substitution(line + start, end - start, &output, &size);
+            // POSIX: trailing newlines are removed, unquoted output is split
+            // into words at spaces, tabs and newlines
+            while (size > 0 && output[size - 1] == '\n')
+                size--;
+            for (size_t j = 0; j < size && top < max_word_count - 1; j++) {
+                bool separator = output[j] == ' ' || output[j] == '\t' || output[j] == '\n';
+                if (opening_quote == no_quote && separator)
+                    END_WORD();
+                else
+                    APPEND(output[j]);
             }
+            free(output);
+            i = end;
         } else {
             if (line[i] == '\'' || line[i] == '\"') {
                 if (opening_quote == no_quote) {
@@ -399,638 +994,5128 @@ int parse_arguments(const char *const line, char **buff) {
                     if (opening_quote == line[i])
                         opening_quote = no_quote;
                 }
+            } else if (line[i] == '$' && line[i + 1] == '?' && opening_quote != '\'') {
+                // exit status of the previous command
+                char status[16];
+                sprintf(status, "%d", last_status);
+                for (char *c = status; *c != '\0'; c++)
+                    APPEND(*c);
+                i++;
             } else
-                buff[top][idx++] = line[i];
+                APPEND(line[i]);
         }
     }
-    if (idx > 0) {
-        buff[top++][idx] = '\0';
-    }
+    if (top < max_word_count - 1)
+        END_WORD();
+    #undef APPEND
+    #undef END_WORD
     buff[top] = NULL;
+    TRACE_END(span, "parse_arguments");
     return top;
 }
 
-// has side effects, adds NULL at the end of the buff
-void execute_command(char *name, char **args, const int args_count) {
-    pid_t id = fork();
-    if (id == 0) {
-        args[args_count] = NULL;
-        execvp(name, args);
-        printf("%s", FG_RED);
-        perror("Error");
-        printf("%s", RESET);
-        exit(EXIT_FAILURE);
-    } else {
-        wait(NULL);
-    }
+double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec * 1e-6;
 }
 
-// returns prompt's content
-char *get_prompt() {
-    char *path = getcwd(NULL, 0);
-    char *out = malloc(1000);
-    sprintf(out, "%s[%s]%s %s$%s ", C_PATH, path, RESET, C_PROMPT, RESET);
-    free(path);
-    return out;
+// fills everything except status and real time
+void stats_from_rusage(struct CommandStats *stats, const struct rusage *usage) {
+    stats->user = timeval_seconds(usage->ru_utime);
+    stats->sys = timeval_seconds(usage->ru_stime);
+    stats->max_rss = usage->ru_maxrss;
+    stats->minor_faults = usage->ru_minflt;
+    stats->major_faults = usage->ru_majflt;
+    stats->voluntary_switches = usage->ru_nvcsw;
+    stats->involuntary_switches = usage->ru_nivcsw;
 }
 
-void cmd_exit() {
-    printf("bye!\n");
-    exit(0);
-}
+double monotonic_seconds();
 
-char last_cd_location[1000] = {'\0'};
-void cmd_cd(int argc, char **argv) {
-    if (argc > 2) {
-        fprintf(stderr, "%stoo many arguments!%s\n", FG_RED, RESET);
-        return;
+// reads fd to the end in large blocks, used to capture output into a memory stream
+bool copy_fd_to_stream(int fd, FILE *stream) {
+    static char block[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, block, sizeof(block))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        fwrite(block, 1, n, stream);
     }
-    char target_location[1000];
+    return true;
+}
 
-    if (argc == 1)
-        strcpy(target_location, getenv("HOME"));
-    else {
-        if (strcmp(argv[1], "-") == 0) {
-            if (last_cd_location[0] == '\0')
-                return;
-            strcpy(target_location, last_cd_location);
-        } else if (strcmp(argv[1], "~") == 0)
-            strcpy(target_location, getenv("HOME"));
-        else
-            strcpy(target_location, argv[1]);
+// Session recording, `record on file [size]`. What the shell and the commands
+// it runs print, keys typed into those commands and every entered command line
+// go into a ring file of a fixed size whose oldest records are overwritten.
+// Output is collected into chunks, a chunk is timestamped and compressed with
+// the bundled LZ4 block compressor when it is full, before a command line and
+// every second. While recording stdout and stderr are streams which write
+// through to their fds and into the chunk, programs run on a pseudo-terminal
+// whose output is spliced to the terminal and teed into the log.
+//
+// The file is a RecordHeader, an index of the last RECORD_INDEX_SLOTS command
+// markers and the ring. A record is a RecordChunk and its payload, LZ4
+// compressed unless that isn't smaller. A marker has the offset of the record
+// of its command line, so a reader seeks straight to any command.
+#define RECORD_MAGIC "MSHREC1"
+#define RECORD_CHUNK_MAGIC 0x4B4E4843
+#define RECORD_CHUNK (1 << 16) // bytes collected before a chunk is compressed
+#define RECORD_COMPRESSED_MAX (RECORD_CHUNK + RECORD_CHUNK / 255 + 16)
+#define RECORD_INDEX_SLOTS 1024
+#define RECORD_HEADER_SIZE 4096
+#define RECORD_DEFAULT_SIZE (16 << 20)
+#define RECORD_MIN_SIZE (1 << 20)
+
+struct RecordHeader {
+    char magic[8];
+    uint64_t capacity; // bytes of the ring
+    uint64_t head; // ring offset of the next record
+    uint64_t tail; // ring offset of the oldest record
+    uint64_t data_end; // records past it were cut off when the ring wrapped
+    uint64_t tail_sequence; // sequence number of the oldest record
+    uint64_t next_sequence;
+    uint64_t marker_count; // markers ever written, slot is number % RECORD_INDEX_SLOTS
+};
+
+struct RecordMarker {
+    uint64_t sequence; // of the record with the command line
+    uint64_t offset;
+    int64_t time; // nanoseconds since the epoch
+};
+
+struct RecordChunk {
+    uint32_t magic;
+    char type; // 'O' output, 'I' input, 'C' command line
+    char reserved[3];
+    uint64_t sequence;
+    int64_t time; // of the first byte, nanoseconds since the epoch
+    uint32_t length; // uncompressed
+    uint32_t stored; // bytes of payload, equal to length if not compressed
+};
+
+#define RECORD_RING_START (RECORD_HEADER_SIZE + RECORD_INDEX_SLOTS * sizeof(struct RecordMarker))
+
+int record_fd = -1;
+pid_t record_pid; // children inherit the state, only the shell writes
+struct RecordHeader record_header;
+char record_path[PATH_MAX];
+char record_chunk[RECORD_CHUNK];
+int record_chunk_length = 0;
+char record_chunk_type;
+int64_t record_chunk_time;
+uint64_t record_bytes_in = 0, record_bytes_stored = 0;
+FILE *record_stdout = NULL, *record_stderr = NULL; // streams which tee into the log
+FILE *record_saved_stdout, *record_saved_stderr;
+int record_timer = -1;
+bool record_paused = false; // watch captures output which isn't shown
+
+// LZ4 block format: a sequence is a token (literal length << 4 | match
+// length - 4), the literals and a 2 byte offset of the match, lengths of 15
+// and more continue in bytes up to 255. The last sequence has only literals,
+// the last 5 bytes are always literals and no match starts in the last 12.
+#define LZ4_HASH_BITS 12
+
+uint32_t load32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// match_length 0 for the last sequence, false if capacity is too small
+bool lz4_sequence(uint8_t *dst, int *out, int capacity, const uint8_t *literals, int literal_length,
+        int offset, int match_length) {
+    if (*out + 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1 > capacity)
+        return false;
+    int match_code = match_length > 0 ? match_length - 4 : 0;
+    dst[(*out)++] = min(literal_length, 15) << 4 | min(match_code, 15);
+    if (literal_length >= 15) {
+        int rest = literal_length - 15;
+        for (; rest >= 255; rest -= 255)
+            dst[(*out)++] = 255;
+        dst[(*out)++] = rest;
     }
-    char tmp[1000];
-    strcpy(tmp, getcwd(NULL, 0));
-    int ret = chdir(target_location);
-    if (ret == -1)
-        fprintf(stderr, "%scd: The directory \"%s\" does not exist%s\n", FG_RED, target_location, RESET);
-    else
-        // update last_cd_location only on success
-        strcpy(last_cd_location, tmp);
+    memcpy(dst + *out, literals, literal_length);
+    *out += literal_length;
+    if (match_length == 0)
+        return true;
+    dst[(*out)++] = offset & 0xFF;
+    dst[(*out)++] = offset >> 8;
+    if (match_code >= 15) {
+        int rest = match_code - 15;
+        for (; rest >= 255; rest -= 255)
+            dst[(*out)++] = 255;
+        dst[(*out)++] = rest;
+    }
+    return true;
 }
 
-void cmd_type(int argc, char **argv) {
-    if (argc == 1) {
-        fprintf(stderr, "%sname a command!%s\n", FG_RED, RESET);
-        return;
+// returns size of the compressed block, 0 if it doesn't fit into capacity
+int lz4_compress(const uint8_t *src, int size, uint8_t *dst, int capacity) {
+    int table[1 << LZ4_HASH_BITS]; // last position of a hash of 4 bytes
+    memset(table, -1, sizeof(table));
+    int anchor = 0, out = 0;
+    for (int i = 0; i + 12 <= size;) {
+        uint32_t sequence = load32(src + i);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        int candidate = table[hash];
+        table[hash] = i;
+        if (candidate < 0 || i - candidate > 65535 || load32(src + candidate) != sequence) {
+            i++;
+            continue;
+        }
+        int length = 4;
+        while (i + length < size - 5 && src[candidate + length] == src[i + length])
+            length++;
+        if (!lz4_sequence(dst, &out, capacity, src + anchor, i - anchor, i - candidate, length))
+            return 0;
+        i += length;
+        anchor = i;
     }
-    if (argc > 2) {
-        fprintf(stderr, "%stoo many arguments!%s\n", FG_RED, RESET);
-        return;
+    if (!lz4_sequence(dst, &out, capacity, src + anchor, size - anchor, 0, 0))
+        return 0;
+    return out;
+}
+
+// returns size of the decompressed data, -1 if the block is corrupt
+int lz4_decompress(const uint8_t *src, int size, uint8_t *dst, int capacity) {
+    int in = 0, out = 0;
+    while (in < size) {
+        int token = src[in++];
+        int literal_length = token >> 4;
+        if (literal_length == 15) {
+            int byte;
+            do {
+                if (in >= size)
+                    return -1;
+                byte = src[in++];
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if (in + literal_length > size || out + literal_length > capacity)
+            return -1;
+        memcpy(dst + out, src + in, literal_length);
+        in += literal_length;
+        out += literal_length;
+        if (in == size)
+            break; // the last sequence
+        if (in + 2 > size)
+            return -1;
+        int offset = src[in] | src[in + 1] << 8;
+        in += 2;
+        int match_length = token & 15;
+        if (match_length == 15) {
+            int byte;
+            do {
+                if (in >= size)
+                    return -1;
+                byte = src[in++];
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += 4;
+        if (offset == 0 || offset > out || out + match_length > capacity)
+            return -1;
+        // byte by byte, the match may overlap what it produces
+        for (int i = 0; i < match_length; i++, out++)
+            dst[out] = dst[out - offset];
     }
-    // argc == 2
-    bool builtin = false;
-    builtin |= strcmp(argv[1], "help") == 0;
-    builtin |= strcmp(argv[1], "exit") == 0;
-    builtin |= strcmp(argv[1], "type") == 0;
-    builtin |= strcmp(argv[1], "calc") == 0;
-    builtin |= strcmp(argv[1], "cd") == 0;
-    builtin |= strcmp(argv[1], "ps") == 0;
-    builtin |= strcmp(argv[1], "args") == 0;
-    if (builtin)
-        printf("builtin\n");
-    else
-        printf("external\n");
+    return out;
 }
 
-// for testing parsing
-void cmd_args(int argc, char **argv) {
-    printf("%d args:\n", argc);
-    for (int i = 0; i < argc; i++)
-        printf("%s\n", argv[i]);
+int64_t realtime_nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void cmd_help() {
-    printf("%smicroshell%s by Maciej Kowalski (481828), avaible commands:\n", BOLD, RESET);
-    printf("  %shelp%s - see this list of avaible commands\n", ITALIC, RESET);
-    printf("  %sexit%s - exit microshell\n", ITALIC, RESET);
-    printf("  %stype%s - see if command is external or a bulitin\n", ITALIC, RESET);
-    printf("  %scalc%s - evaluate an arithmetic expression (dodatkowa komenda powłoki #1)\n", ITALIC, RESET);
-    printf("    %scd%s - change working directory\n", ITALIC, RESET);
-    printf("    %sps%s - list running processes (dodatkowa komenda powłoki #2)\n", ITALIC, RESET);
-    printf("%sbajery:%s\n", BOLD, RESET);
-    printf("* pełna obsługa strzałek\n");
-    printf("* historia poleceń\n");
-    printf("* obsługa argumentów w cudzysłowach\n");
-    printf("* kolorowanie terminala\n");
+bool record_read_chunk(int fd, uint64_t offset, struct RecordChunk *chunk) {
+    return pread(fd, chunk, sizeof(*chunk), RECORD_RING_START + offset) == sizeof(*chunk) &&
+            chunk->magic == RECORD_CHUNK_MAGIC;
 }
 
-bool is_numeric(char *str) {
-    for (int i = 0; i < strlen(str); i++) {
-        if (!isdigit(str[i]))
-            return false;
-    }
-    return true;
+// ring offset of the record following the one at offset
+uint64_t record_next(const struct RecordHeader *header, uint64_t offset, const struct RecordChunk *chunk) {
+    offset += sizeof(*chunk) + chunk->stored;
+    return offset >= header->data_end ? 0 : offset;
 }
 
-void extract(const char * const content, const char * const field, char * outbuff) {
-    char *start = strstr(content, field);
-    if (start == NULL) {
-        fprintf(stderr, "%serror 1%s\n", FG_RED, RESET);
-        exit(1);
-    }
-    start += strlen(field);
-    char *end = strstr(start, "\n") - 1;
-    if (end == NULL) {
-        fprintf(stderr, "%serror 2%s\n", FG_RED, RESET);
-        exit(2);
+void record_evict() {
+    struct RecordHeader *header = &record_header;
+    struct RecordChunk chunk;
+    if (!record_read_chunk(record_fd, header->tail, &chunk)) {
+        header->tail_sequence = header->next_sequence; // can't follow the chain, start over
+        header->tail = header->head;
+        return;
     }
-    int length = end - start + 1;
-    memcpy(outbuff, start, length);
-    outbuff[length] = '\0';
+    header->tail_sequence++;
+    header->tail = header->tail_sequence == header->next_sequence ? header->head : record_next(header, header->tail, &chunk);
 }
 
-struct PSTable {
-    int length;
-    char ***content;
-};
+// appends a record to the ring, returns its offset
+uint64_t record_write(char type, int64_t time, const char *data, int length) {
+    static uint8_t compressed[RECORD_COMPRESSED_MAX];
+    struct RecordHeader *header = &record_header;
+    int stored = lz4_compress((const uint8_t *)data, length, compressed, length - 1);
+    const void *payload = stored > 0 ? (const void *)compressed : data;
+    if (stored == 0)
+        stored = length;
+    struct RecordChunk chunk = {RECORD_CHUNK_MAGIC, type, {0}, header->next_sequence, time, length, stored};
+    uint64_t size = sizeof(chunk) + stored;
 
-void init_ps_table(struct PSTable *tab) {
-    tab->length = 0;
-    tab->content = malloc(4 * sizeof(char **));
-    for (int i = 0; i < 4; i++) {
-        tab->content[i] = malloc(1000 * sizeof(char *));
-        for (int j = 0; j < 1000; j++)
-            tab->content[i][j] = malloc(200);
+    if (header->head + size > header->capacity) {
+        // records between head and the end would be cut off from the newer ones at the start
+        while (header->tail_sequence < header->next_sequence && header->tail >= header->head)
+            record_evict();
+        header->data_end = header->head;
+        header->head = 0;
     }
+    while (header->tail_sequence < header->next_sequence && header->tail >= header->head &&
+            header->tail < header->head + size)
+        record_evict();
+    uint64_t offset = header->head;
+    if (header->tail_sequence == header->next_sequence)
+        header->tail = offset;
+    pwrite(record_fd, &chunk, sizeof(chunk), RECORD_RING_START + offset);
+    pwrite(record_fd, payload, stored, RECORD_RING_START + offset + sizeof(chunk));
+    header->head += size;
+    if (header->head > header->data_end)
+        header->data_end = header->head;
+    header->next_sequence++;
+    pwrite(record_fd, header, sizeof(*header), 0);
+    record_bytes_in += length;
+    record_bytes_stored += size;
+    return offset;
 }
 
-void append_ps_table(struct PSTable *tab, char *col0, char *col1, char *col2, char *col3) {
-    strcpy(tab->content[0][tab->length], col0);
-    strcpy(tab->content[1][tab->length], col1);
-    strcpy(tab->content[2][tab->length], col2);
-    strcpy(tab->content[3][tab->length], col3);
-    tab->length++;
+void record_flush() {
+    if (record_fd == -1 || record_chunk_length == 0 || getpid() != record_pid)
+        return;
+    record_write(record_chunk_type, record_chunk_time, record_chunk, record_chunk_length);
+    record_chunk_length = 0;
 }
 
-int longest_len(char *column[], int n) {
-    int out = 0;
-    for (int i = 0; i < n; i++) {
-        int len = strlen(column[i]);
-        if (len > out)
-            out = len;
+void record_append(char type, const char *data, size_t size) {
+    if (record_fd == -1 || record_paused)
+        return;
+    while (size > 0) {
+        if (record_chunk_length > 0 && record_chunk_type != type)
+            record_flush();
+        if (record_chunk_length == 0) {
+            record_chunk_type = type;
+            record_chunk_time = realtime_nanoseconds();
+        }
+        size_t n = min(size, RECORD_CHUNK - record_chunk_length);
+        memcpy(record_chunk + record_chunk_length, data, n);
+        record_chunk_length += n;
+        data += n;
+        size -= n;
+        if (record_chunk_length == RECORD_CHUNK)
+            record_flush();
     }
-    return out;
 }
 
-void print_ps_table(struct PSTable *tab) {
-    // column lengths
-    int col_w0 = longest_len(tab->content[0], tab->length);
-    int col_w1 = longest_len(tab->content[1], tab->length);
-    int col_w2 = longest_len(tab->content[2], tab->length);
-    int col_w3 = longest_len(tab->content[3], tab->length);
-    for (int i = 0; i < tab->length; i++) {
-        char color_es[50]; // color escape code
-        strcpy(color_es, RESET);
-        // skip header
-        if (i > 0) {
-            // get first letter of STATE column
-            char state = tab->content[3][i][0];
-            // possible values: R, I, S
-            // R - running
-            // I - idle
-            // S - sleeping
-            switch (state) {
-                case 'R':
-                    strcpy(color_es, PS_RUNNING);
-                    break;
-                case 'I':
-                    strcpy(color_es, PS_IDLE);
-                    break;
-                case 'S':
-                    strcpy(color_es, PS_SLEEPING);
+// a command line entered in read_input, pending output goes first
+void record_marker(const char *line) {
+    if (record_fd == -1 || getpid() != record_pid)
+        return;
+    fflush(stdout);
+    record_flush();
+    struct RecordMarker marker = {record_header.next_sequence, 0, realtime_nanoseconds()};
+    marker.offset = record_write('C', marker.time, line, strlen(line));
+    uint64_t slot = record_header.marker_count++ % RECORD_INDEX_SLOTS;
+    pwrite(record_fd, &marker, sizeof(marker), RECORD_HEADER_SIZE + slot * sizeof(marker));
+    pwrite(record_fd, &record_header, sizeof(record_header), 0);
+}
+
+ssize_t record_stream_write(void *cookie, const char *data, size_t size) {
+    int fd = (intptr_t)cookie;
+    for (size_t done = 0; done < size;) {
+        ssize_t n = write(fd, data + done, size - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    record_append('O', data, size);
+    return size;
+}
+
+// stdout has no fd while recording, it still goes to the terminal
+bool stdout_is_terminal() {
+    return isatty(stdout != NULL && stdout == record_stdout ? STDOUT_FILENO : fileno(stdout));
+}
+
+void on_record_tick(int fd, void *data) {
+    read_timer(fd);
+    record_flush();
+}
+
+void record_stop() {
+    if (record_fd == -1 || getpid() != record_pid)
+        return;
+    fflush(stdout);
+    fflush(stderr);
+    record_flush();
+    stdout = record_saved_stdout;
+    stderr = record_saved_stderr;
+    fclose(record_stdout);
+    fclose(record_stderr);
+    record_stdout = record_stderr = NULL;
+    event_remove_timer(record_timer);
+    record_timer = -1;
+    close(record_fd);
+    record_fd = -1;
+}
+
+bool record_start(const char *path, uint64_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    // the whole ring is allocated up front, the file never grows past it
+    if (fd == -1 || ftruncate(fd, RECORD_RING_START + capacity) == -1) {
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    memset(&record_header, 0, sizeof(record_header));
+    memcpy(record_header.magic, RECORD_MAGIC, sizeof(record_header.magic));
+    record_header.capacity = capacity;
+    pwrite(fd, &record_header, sizeof(record_header), 0);
+    record_fd = fd;
+    record_pid = getpid();
+    snprintf(record_path, sizeof(record_path), "%s", path);
+    record_chunk_length = 0;
+    record_bytes_in = record_bytes_stored = 0;
+
+    fflush(stdout);
+    fflush(stderr);
+    cookie_io_functions_t io = {.write = record_stream_write};
+    record_saved_stdout = stdout;
+    record_saved_stderr = stderr;
+    record_stdout = fopencookie((void *)(intptr_t)STDOUT_FILENO, "w", io);
+    record_stderr = fopencookie((void *)(intptr_t)STDERR_FILENO, "w", io);
+    setvbuf(record_stdout, NULL, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, BUFSIZ);
+    setvbuf(record_stderr, NULL, _IONBF, 0);
+    stdout = record_stdout;
+    stderr = record_stderr;
+    record_timer = event_add_timer(1, true, on_record_tick, NULL);
+    static bool registered = false;
+    if (!registered)
+        atexit(record_stop);
+    registered = true;
+    return true;
+}
+
+// A program started while recording runs on a pseudo-terminal. Its output
+// is spliced into a pipe, duplicated with tee into a second pipe for the log
+// and spliced on to the terminal, so the terminal side is never copied
+// through the shell. Where splice isn't supported it falls back to read and write.
+struct Relay {
+    int master;
+    int pipe[2]; // -1 without splice
+    int log_pipe[2];
+    bool open; // until the terminal is closed by everything the command started
+    bool has_config;
+    struct termios config; // of the shell's terminal, the pty starts with it
+};
+
+bool relay_wanted() {
+    return record_fd != -1 && !record_paused && stdout == record_stdout && isatty(STDOUT_FILENO);
+}
+
+bool relay_open(struct Relay *relay, char *slave, size_t size) {
+    relay->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (relay->master == -1)
+        return false;
+    if (grantpt(relay->master) == -1 || unlockpt(relay->master) == -1 || ptsname_r(relay->master, slave, size) != 0) {
+        close(relay->master);
+        return false;
+    }
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0)
+        ioctl(relay->master, TIOCSWINSZ, &w);
+    relay->has_config = tcgetattr(STDIN_FILENO, &relay->config) == 0;
+    relay->pipe[0] = relay->pipe[1] = relay->log_pipe[0] = relay->log_pipe[1] = -1;
+    if (pipe2(relay->pipe, O_CLOEXEC | O_NONBLOCK) == -1 || pipe2(relay->log_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        for (int i = 0; i < 2; i++) {
+            if (relay->pipe[i] != -1)
+                close(relay->pipe[i]);
+        }
+        relay->pipe[0] = -1;
+    }
+    relay->open = true;
+    relay_master = relay->master;
+    return true;
+}
+
+void relay_write(int fd, const char *data, size_t size) {
+    for (size_t done = 0; done < size;) {
+        ssize_t n = write(fd, data + done, size - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        done += n;
+    }
+}
+
+void on_relay_output(int fd, void *data) {
+    struct Relay *relay = data;
+    static char block[RECORD_CHUNK];
+    ssize_t n;
+    if (relay->pipe[0] != -1) {
+        n = splice(fd, NULL, relay->pipe[1], NULL, sizeof(block), SPLICE_F_NONBLOCK);
+        if (n == -1 && errno == EINVAL) {
+            // the terminal driver can't splice, read and write from now on
+            for (int i = 0; i < 2; i++) {
+                close(relay->pipe[i]);
+                close(relay->log_pipe[i]);
+            }
+            relay->pipe[0] = -1;
+            return;
+        }
+        if (n > 0) {
+            ssize_t teed = tee(relay->pipe[0], relay->log_pipe[1], n, SPLICE_F_NONBLOCK);
+            for (ssize_t moved = 0; moved < n;) {
+                ssize_t m = splice(relay->pipe[0], NULL, STDOUT_FILENO, NULL, n - moved, 0);
+                if (m == -1 && errno == EINTR)
+                    continue;
+                if (m <= 0) {
+                    // stdout doesn't take splices, pass the rest through memory
+                    ssize_t rest = read(relay->pipe[0], block, n - moved);
+                    if (rest > 0)
+                        relay_write(STDOUT_FILENO, block, rest);
                     break;
+                }
+                moved += m;
             }
+            ssize_t logged = teed > 0 ? read(relay->log_pipe[0], block, teed) : 0;
+            if (logged > 0)
+                record_append('O', block, logged);
+            return;
+        }
+    } else {
+        n = read(fd, block, sizeof(block));
+        if (n > 0) {
+            relay_write(STDOUT_FILENO, block, n);
+            record_append('O', block, n);
+            return;
         }
-        char format[1000];
-        sprintf(format, "%%%ds  %%%ds  %%-%ds  %s%%-%ds%s\n",
-                col_w0, col_w1, col_w2, color_es, col_w3, RESET);
-        printf(format,
-                tab->content[0][i],
-                tab->content[1][i],
-                tab->content[2][i],
-                tab->content[3][i]);
     }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    // EIO once the command and everything it started closed the terminal
+    event_remove(fd);
+    relay->open = false;
 }
 
-void free_ps_table(struct PSTable *tab) {
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 1000; j++)
-            free(tab->content[i][j]);
-        free(tab->content[i]);
+void on_relay_input(int fd, void *data) {
+    struct Relay *relay = data;
+    char keys[4096];
+    ssize_t n = read(fd, keys, sizeof(keys));
+    if (n > 0) {
+        relay_write(relay->master, keys, n);
+        record_append('I', keys, n);
+    } else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+        event_remove(fd);
+}
+
+void on_relay_timeout(int fd, void *data) {
+    read_timer(fd);
+    *(bool *)data = true;
+}
+
+void relay_close(struct Relay *relay) {
+    event_remove(relay->master);
+    close(relay->master);
+    relay_master = -1;
+    if (relay->pipe[0] != -1) {
+        for (int i = 0; i < 2; i++) {
+            close(relay->pipe[i]);
+            close(relay->log_pipe[i]);
+        }
     }
-    free(tab->content);
 }
 
-void cmd_ps() {
-    DIR *proc_dir = opendir("/proc");
-    struct dirent *entry;
-    struct PSTable tab;
-    init_ps_table(&tab);
-    append_ps_table(&tab, "PID", "PPID", "NAME", "STATE");
-    while ((entry = readdir(proc_dir)) != NULL) {
-        if (is_numeric(entry->d_name)) {
-            char status_path[1000];
-            sprintf(status_path, "/proc/%s/status", entry->d_name);
-            int status_fd = open(status_path, O_RDONLY);
+// Limits of the `limit` builtin, set in the child between fork and exec so
+// that no prlimit, taskset or nice has to be exec'ed in front of the command
+enum LimitKind {
+    LIMIT_MEM = 1,
+    LIMIT_CPU_TIME = 2,
+};
 
-            char file_content[1000];
-            read(status_fd, file_content, 1000);
-            close(status_fd);
+// Running out of address space leaves no trace once the process is gone: a
+// refused mmap doesn't move VmPeak and a zombie has no memory map left to read.
+// So a --mem child reports its mmap and mremap calls to the shell through a
+// seccomp listener, the shell compares each with the cap and lets it go on,
+// the kernel enforces the limit itself.
+struct AllocationObserver {
+    int socket[2]; // the child sends its listener through socket[1]
+    int listener; // -1 if the child couldn't set it up
+    rlim_t cap;
+    long refused; // calls which went past the cap
+    uint64_t largest; // bytes asked for by the largest of them
+};
+
+struct SpawnLimits {
+    struct AllocationObserver observer; // set up with mem
+    rlim_t mem; // bytes of address space, 0 - no limit
+    rlim_t cpu_time; // seconds
+    rlim_t nofile; // open files
+    bool has_cpus;
+    cpu_set_t cpus;
+    bool has_nice;
+    int nice;
+};
 
-            char name[1000];
-            extract(file_content, "Name:\t", name);
-            char pid[1000];
-            extract(file_content, "Pid:\t", pid);
-            char ppid[1000];
-            extract(file_content, "PPid:\t", ppid);
-            char state[1000];
-            extract(file_content, "State:\t", state);
+struct SpawnLimits *spawn_limits = NULL; // set while `limit` runs its command
 
-            append_ps_table(&tab, pid, ppid, name, state);
+bool send_fd(int socket, int fd) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    return sendmsg(socket, &message, MSG_NOSIGNAL) == 1;
+}
+
+// returns the received fd, -1 when the other end closed without sending one
+int receive_fd(int socket) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t n;
+    while ((n = recvmsg(socket, &message, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    struct cmsghdr *header = n == 1 ? CMSG_FIRSTHDR(&message) : NULL;
+    if (header == NULL || header->cmsg_type != SCM_RIGHTS)
+        return -1;
+    int fd;
+    memcpy(&fd, CMSG_DATA(header), sizeof(int));
+    return fd;
+}
+
+// in the child, without a listener the command runs unobserved
+void observe_allocations(int socket) {
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_mmap, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_mremap, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog program = {sizeof(filter) / sizeof(filter[0]), filter};
+    // required for a filter without CAP_SYS_ADMIN, setuid programs don't gain privileges
+    int listener = -1;
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0)
+        listener = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &program);
+    if (listener != -1) {
+        send_fd(socket, listener);
+        close(listener);
+    }
+    close(socket);
+}
+
+// kilobytes of address space of a process or thread, -1 if it's gone
+long process_vm_size(pid_t pid) {
+    char path[64], content[4096];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t n = read(fd, content, sizeof(content) - 1);
+    close(fd);
+    content[max(0, n)] = '\0';
+    const char *line = strstr(content, "\nVmSize:");
+    return line == NULL ? -1 : strtol(line + strlen("\nVmSize:"), NULL, 10);
+}
+
+void on_allocation_request(int fd, void *data) {
+    struct AllocationObserver *observer = data;
+    struct seccomp_notif request;
+    memset(&request, 0, sizeof(request));
+    // fails when the caller died meanwhile, or with a hangup once all exited
+    if (ioctl(fd, SECCOMP_IOCTL_NOTIF_RECV, &request) == -1)
+        return;
+    uint64_t growth = 0;
+    if (request.data.nr == SYS_mmap)
+        growth = request.data.args[1];
+    else if (request.data.args[2] > request.data.args[1]) // mremap to a larger size
+        growth = request.data.args[2] - request.data.args[1];
+    long page = sysconf(_SC_PAGESIZE);
+    growth = (growth + page - 1) / page * page;
+    long size = growth > 0 ? process_vm_size(request.pid) : -1;
+    // the same test as the kernel's, it refuses the call after we answer
+    if (size >= 0 && (uint64_t)size * 1024 + growth > observer->cap) {
+        observer->refused++;
+        if (growth > observer->largest)
+            observer->largest = growth;
+    }
+    struct seccomp_notif_resp response = {.id = request.id, .flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE};
+    ioctl(fd, SECCOMP_IOCTL_NOTIF_SEND, &response);
+}
+
+// in the child, returns name of the limit which couldn't be set
+const char *apply_spawn_limits(const struct SpawnLimits *limits) {
+    // CPU time: SIGXCPU at the soft limit, SIGKILL a second later
+    struct rlimit mem = {limits->mem, limits->mem};
+    struct rlimit cpu_time = {limits->cpu_time, limits->cpu_time + 1};
+    struct rlimit nofile = {limits->nofile, limits->nofile};
+    if (limits->mem > 0 && setrlimit(RLIMIT_AS, &mem) == -1)
+        return "mem";
+    if (limits->cpu_time > 0 && setrlimit(RLIMIT_CPU, &cpu_time) == -1)
+        return "time";
+    if (limits->nofile > 0 && setrlimit(RLIMIT_NOFILE, &nofile) == -1)
+        return "nofile";
+    if (limits->has_cpus && sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) == -1)
+        return "cpu";
+    if (limits->has_nice && setpriority(PRIO_PROCESS, 0, limits->nice) == -1)
+        return "nice";
+    if (limits->mem > 0)
+        observe_allocations(limits->observer.socket[1]);
+    return NULL;
+}
+
+// the parent's end of the socket, -1 if the child closed it without a listener
+void observer_start(struct AllocationObserver *observer) {
+    close(observer->socket[1]);
+    observer->listener = receive_fd(observer->socket[0]);
+    close(observer->socket[0]);
+    if (observer->listener != -1 && !event_add(observer->listener, on_allocation_request, observer)) {
+        // the child would wait for answers forever
+        close(observer->listener);
+        observer->listener = -1;
+    }
+}
+
+void observer_stop(struct AllocationObserver *observer) {
+    if (observer->listener == -1)
+        return;
+    event_remove(observer->listener);
+    close(observer->listener);
+}
+
+void on_child_exit(int fd, void *data) {
+    *(bool *)data = true;
+}
+
+// a pipe from the child forwarded into one of our streams
+struct Capture {
+    int fd; // -1 once the child closed its end
+    FILE *stream;
+};
+
+void on_capture_output(int fd, void *data) {
+    struct Capture *capture = data;
+    static char block[1 << 16];
+    ssize_t n = read(fd, block, sizeof(block));
+    if (n == -1 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (n > 0) {
+        fwrite(block, 1, n, capture->stream);
+        fflush(capture->stream); // a server worker streams it out right away
+        return;
+    }
+    event_remove(fd);
+    close(fd);
+    capture->fd = -1;
+}
+
+// has side effects, adds NULL at the end of the buff
+// returns exit status of the command (128 + signal number if it was killed),
+// stats get the command's resource usage reported by wait4
+int execute_command(char *name, char **args, const int args_count, struct CommandStats *stats) {
+    fflush(stdout);
+    fflush(stderr);
+    // stdout is a memory stream during command substitution and both streams
+    // are socket frames in a server worker, then the child writes into pipes.
+    // While recording to a terminal the child gets a pty relayed by the loop.
+    struct Relay relay;
+    char slave[64];
+    bool relayed = relay_wanted() && relay_open(&relay, slave, sizeof(slave));
+    struct Capture captures[2] = {{-1, stdout}, {-1, stderr}};
+    int writers[2] = {-1, -1};
+    for (int i = 0; i < 2; i++) {
+        int fds[2];
+        if (!relayed && fileno(captures[i].stream) == -1 && pipe2(fds, O_CLOEXEC) == 0) {
+            captures[i].fd = fds[0];
+            writers[i] = fds[1];
         }
     }
-    print_ps_table(&tab);
-    free_ps_table(&tab);
-    closedir(proc_dir);
+    double start = monotonic_seconds();
+    TRACE_BEGIN(fork_span);
+    pid_t id = fork();
+    if (id == -1) {
+        TRACE_END(fork_span, "fork");
+        fprintf(stderr, "%sError: %s%s\n", FG_RED, strerror(errno), RESET);
+        for (int i = 0; i < 2; i++) {
+            if (captures[i].fd != -1) {
+                close(captures[i].fd);
+                close(writers[i]);
+            }
+        }
+        if (relayed)
+            relay_close(&relay);
+        struct rusage usage = {0};
+        stats->real = monotonic_seconds() - start;
+        stats_from_rusage(stats, &usage);
+        stats->status = EXIT_FAILURE;
+        return stats->status;
+    }
+    if (id == 0) {
+        sigprocmask(SIG_SETMASK, &original_signal_mask, NULL);
+        if (relayed) {
+            setsid();
+            int terminal = open(slave, O_RDWR); // becomes the controlling terminal
+            if (terminal != -1) {
+                if (relay.has_config)
+                    tcsetattr(terminal, TCSANOW, &relay.config);
+                if (stdin_is_terminal)
+                    dup2(terminal, STDIN_FILENO);
+                dup2(terminal, STDOUT_FILENO);
+                dup2(terminal, STDERR_FILENO);
+                if (terminal > STDERR_FILENO)
+                    close(terminal);
+            }
+        }
+        if (writers[0] != -1)
+            dup2(writers[0], STDOUT_FILENO);
+        if (writers[1] != -1)
+            dup2(writers[1], STDERR_FILENO);
+        const char *failed = spawn_limits == NULL ? NULL : apply_spawn_limits(spawn_limits);
+        if (failed != NULL) {
+            fprintf(stderr, "%slimit: --%s: %s%s\n", FG_RED, failed, strerror(errno), RESET);
+            exit(126);
+        }
+        args[args_count] = NULL;
+        execvp(name, args);
+        fprintf(stderr, "%sError: %s%s\n", FG_RED, strerror(errno), RESET);
+        exit(EXIT_FAILURE);
+    } else {
+        TRACE_END(fork_span, "fork");
+        if (spawn_limits != NULL && spawn_limits->mem > 0)
+            observer_start(&spawn_limits->observer);
+        // exec happens in the child, its time is part of the wait
+        TRACE_BEGIN(wait_span);
+        for (int i = 0; i < 2; i++) {
+            if (captures[i].fd == -1)
+                continue;
+            close(writers[i]);
+            if (!event_add(captures[i].fd, on_capture_output, &captures[i])) {
+                copy_fd_to_stream(captures[i].fd, captures[i].stream);
+                close(captures[i].fd);
+                captures[i].fd = -1;
+            }
+        }
+        // the loop keeps handling resizes, the git job and timers meanwhile,
+        // wait4 only reaps the child once its pidfd says it exited
+        int pid_fd = syscall(SYS_pidfd_open, id, 0);
+        bool exited = false;
+        bool listening = stdin_listening;
+        listen_stdin(false); // keys typed now belong to the child
+        if (pid_fd == -1 || !event_add(pid_fd, on_child_exit, &exited))
+            exited = true; // wait4 blocks instead
+        struct termios terminal_config;
+        bool raw = false;
+        if (relayed) {
+            if (!event_add(relay.master, on_relay_output, &relay))
+                relay.open = false;
+            // keys go to the pty as they are typed, its line discipline handles them
+            if (stdin_is_terminal && tcgetattr(STDIN_FILENO, &terminal_config) == 0) {
+                struct termios config = terminal_config;
+                cfmakeraw(&config);
+                raw = tcsetattr(STDIN_FILENO, TCSANOW, &config) == 0;
+                event_add(STDIN_FILENO, on_relay_input, &relay);
+            }
+        }
+        while (!exited || captures[0].fd != -1 || captures[1].fd != -1)
+            event_run_once(-1);
+        if (relayed) {
+            // the last output may still be on its way through the pty, which
+            // reports EIO once nothing holds the other side open anymore
+            bool timeout = false;
+            int timer = event_add_timer(0.5, false, on_relay_timeout, &timeout);
+            while (relay.open && !timeout && timer != -1)
+                event_run_once(-1);
+            event_remove_timer(timer);
+            if (stdin_is_terminal)
+                event_remove(STDIN_FILENO);
+            if (raw)
+                tcsetattr(STDIN_FILENO, TCSANOW, &terminal_config);
+            relay_close(&relay);
+        }
+        listen_stdin(listening);
+        if (spawn_limits != NULL && spawn_limits->mem > 0)
+            observer_stop(&spawn_limits->observer);
+        if (pid_fd != -1) {
+            event_remove(pid_fd);
+            close(pid_fd);
+        }
+        int status = 0;
+        struct rusage usage = {0};
+        while (wait4(id, &status, 0, &usage) == -1 && errno == EINTR)
+            ;
+        TRACE_END(wait_span, "wait");
+        stats->real = monotonic_seconds() - start;
+        stats_from_rusage(stats, &usage);
+        if (WIFSIGNALED(status))
+            stats->status = 128 + WTERMSIG(status);
+        else
+            stats->status = WEXITSTATUS(status);
+        return stats->status;
+    }
 }
 
-struct MathToken {
-    double value;
-    char operation; // '+', '-', '*', '/', '^', '\0' - for value tokens
-    int nesting_level;
+// Prompt is built from segments. Each segment is cached and refreshed only by
+// the event it depends on: cwd by cd, status and duration by command completion.
+// Git branch and dirty state are computed by a background child which writes its
+// results into a pipe; read_input polls it and redraws the prompt when they arrive.
+
+#define GIT_TIME_BUDGET 1.0 // seconds before the git child is killed
+
+enum PromptSegmentId {
+    SEGMENT_CWD,
+    SEGMENT_GIT,
+    SEGMENT_STATUS,
+    SEGMENT_DURATION,
+    SEGMENT_COUNT
 };
 
-int operation_priority(struct MathToken *token) {
-    int priority = token->nesting_level * 3;
-    if (token->operation == '+' || token->operation == '-')
-        priority += 0;
-    if (token->operation == '*' || token->operation == '/')
-        priority += 1;
-    if (token->operation == '^')
-        priority += 2;
-    return priority;
+char prompt_segments[SEGMENT_COUNT][4200];
+char prompt_cache[SEGMENT_COUNT * 4200 + 100];
+bool prompt_dirty = true;
+
+double last_duration = 0; // seconds
+
+char git_branch[256] = {'\0'};
+int git_dirty = -1; // -1 - unknown, 0 - clean, 1 - dirty
+pid_t git_job_pid = -1;
+int git_job_fd = -1;
+int git_job_timer = -1;
+char git_job_buffer[512];
+int git_job_length = 0;
+bool git_job_got_branch = false;
+
+double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-void push_value_token(struct MathToken *tokens, int *size, double value, int nesting_level) {
-    tokens[*size].operation = '\0';
-    tokens[*size].value = value;
-    tokens[*size].nesting_level = nesting_level;
-    (*size)++;
+void set_prompt_segment(enum PromptSegmentId id, const char *const format, ...) {
+    char buff[sizeof(prompt_segments[0])];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buff, sizeof(buff), format, args);
+    va_end(args);
+    if (strcmp(buff, prompt_segments[id]) != 0) {
+        strcpy(prompt_segments[id], buff);
+        prompt_dirty = true;
+    }
 }
 
-void push_operation_token(struct MathToken *tokens, int *size, char operation, int nesting_level) {
-    tokens[*size].operation = operation;
-    tokens[*size].value = -2137.;
-    tokens[*size].nesting_level = nesting_level;
-    (*size)++;
+void update_git_segment() {
+    if (git_branch[0] == '\0')
+        set_prompt_segment(SEGMENT_GIT, "");
+    else
+        set_prompt_segment(SEGMENT_GIT, " %s(%s%s)%s", C_GIT, git_branch, git_dirty == 1 ? "*" : "", RESET);
 }
 
-void print_token(const struct MathToken * const token) {
-    if (token->operation == '\0')
-        printf("%10f  %d\n", token->value, token->nesting_level);
+// finds git directory of cwd, returns false if cwd is not inside a repository
+bool find_git_dir(char *out, int size) {
+    char path[4096];
+    if (getcwd(path, sizeof(path)) == NULL)
+        return false;
+    while (true) {
+        snprintf(out, size, "%s/.git", strcmp(path, "/") == 0 ? "" : path);
+        struct stat st;
+        if (stat(out, &st) == 0) {
+            if (S_ISDIR(st.st_mode))
+                return true;
+            // worktrees and submodules have a file with "gitdir: <path>"
+            FILE *file = fopen(out, "r");
+            if (file == NULL)
+                return false;
+            char line[4096];
+            bool ok = fgets(line, sizeof(line), file) != NULL && strncmp(line, "gitdir: ", 8) == 0;
+            fclose(file);
+            if (!ok)
+                return false;
+            line[strcspn(line, "\n")] = '\0';
+            if (line[8] == '/')
+                snprintf(out, size, "%s", line + 8);
+            else
+                snprintf(out, size, "%s/%s", path, line + 8);
+            return true;
+        }
+        char *slash = strrchr(path, '/');
+        if (slash == NULL || slash == path)
+            return false;
+        *slash = '\0';
+    }
+}
+
+// runs in the git child, reports "branch <name>" and then "dirty <0|1>"
+void git_job(int out_fd) {
+    char git_dir[4096];
+    if (!find_git_dir(git_dir, sizeof(git_dir)))
+        _exit(0);
+    char head_path[4200];
+    snprintf(head_path, sizeof(head_path), "%s/HEAD", git_dir);
+    FILE *head = fopen(head_path, "r");
+    if (head == NULL)
+        _exit(0);
+    char line[512] = {'\0'};
+    fgets(line, sizeof(line), head);
+    fclose(head);
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "ref: refs/heads/", 16) == 0)
+        dprintf(out_fd, "branch %s\n", line + 16);
     else
-        printf("%10c  %d\n", token->operation, token->nesting_level);
+        dprintf(out_fd, "branch %.7s\n", line); // detached HEAD
+    // dirty state - any output of git status means changes
+    int fds[2];
+    if (pipe(fds) == -1)
+        _exit(0);
+    pid_t id = fork();
+    if (id == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDERR_FILENO);
+        close(fds[0]);
+        execlp("git", "git", "--no-optional-locks", "status", "--porcelain", "--untracked-files=no", NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    char c;
+    ssize_t r = read(fds[0], &c, 1);
+    close(fds[0]);
+    int status = 0;
+    waitpid(id, &status, 0);
+    if (r == 1)
+        dprintf(out_fd, "dirty 1\n");
+    else if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        dprintf(out_fd, "dirty 0\n");
+    _exit(0);
 }
 
-void print_tokens(struct MathToken *tokens, int size) {
-    printf("%10s  %s\n", "value", "nesting level");
-    for (int i = 0; i < size; i++)
-        print_token(tokens + i);
+void cancel_git_job() {
+    if (git_job_pid == -1)
+        return;
+    kill(-git_job_pid, SIGKILL); // whole group, git included
+    waitpid(git_job_pid, NULL, 0);
+    event_remove(git_job_fd);
+    close(git_job_fd);
+    event_remove_timer(git_job_timer);
+    git_job_pid = -1;
+    git_job_fd = -1;
+    git_job_timer = -1;
 }
 
-// [from, to] inclusive
-void replace_tokens(struct MathToken *tokens, int *size, int from, int to, const struct MathToken * const new_token) {
-    int removed_count = to - from + 1;
-    int shift = removed_count - 1;
-    // shift tokens [to + 1, size - 1] by `shift` to left
-    for (int i = to + 1; i < *size; i++)
-        memcpy(tokens + i - shift, tokens + i, sizeof(struct MathToken));
-    // insert copy of new token into correct position
-    memcpy(tokens + from, new_token, sizeof(struct MathToken));
+void read_git_job();
+
+void on_git_job_output(int fd, void *data) {
+    read_git_job();
+}
+
+// out of time budget - keep the branch, leave dirty state unknown
+void on_git_job_timeout(int fd, void *data) {
+    read_timer(fd);
+    cancel_git_job();
+}
+
+void start_git_job() {
+    cancel_git_job();
+    int fds[2];
+    if (pipe(fds) == -1)
+        return;
+    fflush(stdout);
+    pid_t id = fork();
+    if (id == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (id == 0) {
+        sigprocmask(SIG_SETMASK, &original_signal_mask, NULL);
+        setpgid(0, 0);
+        close(fds[0]);
+        git_job(fds[1]);
+    }
+    setpgid(id, id);
+    close(fds[1]);
+    git_job_pid = id;
+    git_job_fd = fds[0];
+    git_job_length = 0;
+    git_job_got_branch = false;
+    event_add(git_job_fd, on_git_job_output, NULL);
+    git_job_timer = event_add_timer(GIT_TIME_BUDGET, false, on_git_job_timeout, NULL);
+}
+
+// reads results of the git child
+void read_git_job() {
+    ssize_t r = read(git_job_fd, git_job_buffer + git_job_length, sizeof(git_job_buffer) - 1 - git_job_length);
+    if (r <= 0) {
+        waitpid(git_job_pid, NULL, 0);
+        event_remove(git_job_fd);
+        close(git_job_fd);
+        event_remove_timer(git_job_timer);
+        git_job_pid = -1;
+        git_job_fd = -1;
+        git_job_timer = -1;
+        if (!git_job_got_branch) {
+            // not a repository (anymore)
+            git_branch[0] = '\0';
+            git_dirty = -1;
+            update_git_segment();
+        }
+        return;
+    }
+    git_job_length += r;
+    git_job_buffer[git_job_length] = '\0';
+    char *newline;
+    while ((newline = strchr(git_job_buffer, '\n')) != NULL) {
+        *newline = '\0';
+        if (strncmp(git_job_buffer, "branch ", 7) == 0) {
+            git_job_got_branch = true;
+            snprintf(git_branch, sizeof(git_branch), "%.255s", git_job_buffer + 7);
+        } else if (strncmp(git_job_buffer, "dirty ", 6) == 0)
+            git_dirty = atoi(git_job_buffer + 6);
+        git_job_length -= newline + 1 - git_job_buffer;
+        memmove(git_job_buffer, newline + 1, git_job_length + 1);
+    }
+    update_git_segment();
+}
+
+// runs the event loop until a key can be read, returns false when the prompt
+// has to be redrawn first (a segment changed or the terminal was resized)
+bool wait_for_key() {
+    fflush(stdout);
+    while (typeahead_start == typeahead_end && !stdin_eof) {
+        if (prompt_dirty || terminal_resized) {
+            terminal_resized = false;
+            return false;
+        }
+        if (!stdin_listening)
+            return true; // reading blocks
+        event_run_once(-1);
+    }
+    return true;
+}
+
+// cwd changed
+void prompt_on_cd() {
+    char path[4096];
+    if (getcwd(path, sizeof(path)) == NULL)
+        strcpy(path, "?");
+    set_prompt_segment(SEGMENT_CWD, "%s[%s]%s", C_PATH, path, RESET);
+}
+
+// command finished, duration in seconds
+void prompt_on_command_done(int status, double duration) {
+    last_status = status;
+    last_duration = duration;
+    if (status != 0)
+        set_prompt_segment(SEGMENT_STATUS, " %s[%d]%s", FG_RED, status, RESET);
+    else
+        set_prompt_segment(SEGMENT_STATUS, "");
+    if (duration >= 1)
+        set_prompt_segment(SEGMENT_DURATION, " %s%.1fs%s", FG_YELLOW, duration, RESET);
+    else
+        set_prompt_segment(SEGMENT_DURATION, "");
+    // the command could have changed the repository or cwd, the old branch
+    // is shown until the git child reports, so that it doesn't flicker
+    start_git_job();
+}
+
+// returns prompt's content, valid until the next call
+const char *get_prompt() {
+    TRACE_BEGIN(span);
+    if (prompt_dirty) {
+        if (prompt_segments[SEGMENT_CWD][0] == '\0') {
+            prompt_on_cd();
+            start_git_job();
+        }
+        int length = 0;
+        for (int i = 0; i < SEGMENT_COUNT; i++)
+            length += sprintf(prompt_cache + length, "%s", prompt_segments[i]);
+        sprintf(prompt_cache + length, " %s$%s ", C_PROMPT, RESET);
+        prompt_dirty = false;
+    }
+    TRACE_END(span, "get_prompt");
+    return prompt_cache;
+}
+
+void cmd_exit() {
+    printf("bye!\n");
+    exit(0);
+}
+
+// Frecency index of visited directories for the `z` builtin.
+// Stored in ~/.microshell_z as a header followed by records:
+//   double rank, uint32 last visit time, uint16 path length, uint16 reserved, path
+// A visit of a known directory rewrites only its rank and time in place, a new
+// directory is appended, the file is rewritten only when ranks are aged.
+
+#define Z_MAGIC "MSZ1"
+#define Z_HEADER_SIZE 8
+#define Z_RECORD_SIZE 16 // without the path
+#define Z_MAX_TOTAL_RANK 10000 // ranks are aged when their sum exceeds this
+
+struct ZEntry {
+    uint32_t path; // offset in z_arena
+    uint32_t lower_path; // offset of lowercase copy in z_lower_arena
+    uint16_t length;
+    bool mixed_case; // path differs from its lowercase copy
+    double rank;
+    uint32_t time;
+    long offset; // of the record in the file
+};
+
+struct ZEntry *z_entries = NULL;
+// Characters and pairs of adjacent characters present in every path, kept apart
+// from the entries so that a query can reject most of them by walking 16 bytes
+// per entry. Only the rest is searched for the query terms.
+uint64_t *z_masks = NULL;
+uint64_t *z_pair_masks = NULL;
+int z_count = 0, z_capacity = 0;
+char *z_arena = NULL, *z_lower_arena = NULL;
+size_t z_arena_size = 0, z_arena_capacity = 0;
+int *z_table = NULL; // open addressing hash table of entry indices, -1 - empty
+int z_table_size = 0;
+bool z_loaded = false;
+// state of the file after our last read or write, to notice other shells' changes
+off_t z_file_size = -1;
+struct timespec z_file_mtime;
+
+bool z_file_path(char *out, int size) {
+    const char *home = getenv("HOME");
+    if (home == NULL)
+        return false;
+    snprintf(out, size, "%s/.microshell_z", home);
+    return true;
+}
+
+uint64_t z_char_bit(char c) {
+    c = tolower(c);
+    if (c >= 'a' && c <= 'z')
+        return 1ULL << (c - 'a');
+    if (c >= '0' && c <= '9')
+        return 1ULL << (c - '0' + 26);
+    return 1ULL << ((unsigned char)c % 28 + 36);
+}
+
+// for already lowercase characters
+uint64_t z_pair_bit(char a, char b) {
+    return 1ULL << (((unsigned char)a * 33u + (unsigned char)b) * 2654435761u >> 26);
+}
+
+uint32_t z_hash(const char *str, int length) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    return hash;
+}
+
+const char *z_path(const struct ZEntry *entry) {
+    return z_arena + entry->path;
+}
+
+const char *z_lower_path(const struct ZEntry *entry) {
+    return z_lower_arena + entry->lower_path;
+}
+
+void z_rebuild_table() {
+    free(z_table);
+    z_table_size = 1024;
+    while (z_table_size < z_count * 2)
+        z_table_size *= 2;
+    z_table = malloc(z_table_size * sizeof(int));
+    for (int i = 0; i < z_table_size; i++)
+        z_table[i] = -1;
+    for (int i = 0; i < z_count; i++) {
+        uint32_t slot = z_hash(z_path(&z_entries[i]), z_entries[i].length) & (z_table_size - 1);
+        while (z_table[slot] != -1)
+            slot = (slot + 1) & (z_table_size - 1);
+        z_table[slot] = i;
+    }
+}
+
+int z_find(const char *path, int length) {
+    if (z_table == NULL)
+        return -1;
+    uint32_t slot = z_hash(path, length) & (z_table_size - 1);
+    while (z_table[slot] != -1) {
+        struct ZEntry *entry = &z_entries[z_table[slot]];
+        if (entry->length == length && memcmp(z_path(entry), path, length) == 0)
+            return z_table[slot];
+        slot = (slot + 1) & (z_table_size - 1);
+    }
+    return -1;
+}
+
+// adds entry to memory (not to the file), returns its index
+int z_add(const char *path, int length, double rank, uint32_t time, long offset) {
+    if (z_count == z_capacity) {
+        z_capacity = z_capacity == 0 ? 256 : z_capacity * 2;
+        z_entries = realloc(z_entries, z_capacity * sizeof(struct ZEntry));
+        z_masks = realloc(z_masks, z_capacity * sizeof(uint64_t));
+        z_pair_masks = realloc(z_pair_masks, z_capacity * sizeof(uint64_t));
+    }
+    while (z_arena_size + length + 1 > z_arena_capacity) {
+        z_arena_capacity = z_arena_capacity == 0 ? 1 << 16 : z_arena_capacity * 2;
+        z_arena = realloc(z_arena, z_arena_capacity);
+        z_lower_arena = realloc(z_lower_arena, z_arena_capacity);
+    }
+    struct ZEntry *entry = &z_entries[z_count];
+    entry->path = z_arena_size;
+    entry->lower_path = z_arena_size;
+    entry->length = length;
+    entry->rank = rank;
+    entry->time = time;
+    entry->offset = offset;
+    z_masks[z_count] = 0;
+    z_pair_masks[z_count] = 0;
+    char *copy = z_arena + z_arena_size;
+    char *lower_copy = z_lower_arena + z_arena_size;
+    memcpy(copy, path, length);
+    copy[length] = '\0';
+    for (int i = 0; i < length; i++) {
+        lower_copy[i] = tolower(path[i]);
+        z_masks[z_count] |= z_char_bit(path[i]);
+        if (i > 0)
+            z_pair_masks[z_count] |= z_pair_bit(lower_copy[i - 1], lower_copy[i]);
+    }
+    lower_copy[length] = '\0';
+    entry->mixed_case = memcmp(copy, lower_copy, length) != 0;
+    z_arena_size += length + 1;
+    z_count++;
+    if (z_count * 2 > z_table_size)
+        z_rebuild_table();
+    else {
+        uint32_t slot = z_hash(path, length) & (z_table_size - 1);
+        while (z_table[slot] != -1)
+            slot = (slot + 1) & (z_table_size - 1);
+        z_table[slot] = z_count - 1;
+    }
+    return z_count - 1;
+}
+
+void z_clear() {
+    z_count = 0;
+    z_arena_size = 0;
+    z_rebuild_table();
+}
+
+void z_remember_file_state(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        z_file_size = st.st_size;
+        z_file_mtime = st.st_mtim;
+    }
+}
+
+// loads the index from an open file
+void z_load_fd(int fd) {
+    z_clear();
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < Z_HEADER_SIZE)
+        return;
+    char *data = malloc(st.st_size);
+    ssize_t size = pread(fd, data, st.st_size, 0);
+    if (size >= Z_HEADER_SIZE && memcmp(data, Z_MAGIC, 4) == 0) {
+        long offset = Z_HEADER_SIZE;
+        while (offset + Z_RECORD_SIZE <= size) {
+            double rank;
+            uint32_t time;
+            uint16_t length;
+            memcpy(&rank, data + offset, 8);
+            memcpy(&time, data + offset + 8, 4);
+            memcpy(&length, data + offset + 12, 2);
+            if (offset + Z_RECORD_SIZE + length > size)
+                break; // truncated record
+            if (z_find(data + offset + Z_RECORD_SIZE, length) == -1)
+                z_add(data + offset + Z_RECORD_SIZE, length, rank, time, offset);
+            offset += Z_RECORD_SIZE + length;
+        }
+    }
+    free(data);
+    z_file_size = st.st_size;
+    z_file_mtime = st.st_mtim;
+}
+
+void z_load() {
+    char path[4200];
+    z_loaded = true;
+    if (!z_file_path(path, sizeof(path)))
+        return;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        z_clear();
+        return;
+    }
+    flock(fd, LOCK_SH);
+    z_load_fd(fd);
+    close(fd);
+}
+
+void z_write_record(int fd, const struct ZEntry *entry) {
+    char record[Z_RECORD_SIZE] = {0};
+    memcpy(record, &entry->rank, 8);
+    memcpy(record + 8, &entry->time, 4);
+    memcpy(record + 12, &entry->length, 2);
+    pwrite(fd, record, Z_RECORD_SIZE, entry->offset);
+    pwrite(fd, z_path(entry), entry->length, entry->offset + Z_RECORD_SIZE);
+}
+
+// ages ranks and rewrites the whole file, dropping forgotten directories
+void z_compact(int fd) {
+    struct ZEntry *old_entries = z_entries;
+    char *old_arena = z_arena;
+    int old_count = z_count;
+    free(z_lower_arena);
+    free(z_masks);
+    free(z_pair_masks);
+    z_masks = NULL;
+    z_pair_masks = NULL;
+    z_entries = NULL;
+    z_arena = NULL;
+    z_lower_arena = NULL;
+    z_count = z_capacity = 0;
+    z_arena_size = z_arena_capacity = 0;
+    z_clear();
+    long offset = Z_HEADER_SIZE;
+    for (int i = 0; i < old_count; i++) {
+        double rank = old_entries[i].rank * 0.9;
+        if (rank < 1)
+            continue;
+        z_add(old_arena + old_entries[i].path, old_entries[i].length, rank, old_entries[i].time, offset);
+        offset += Z_RECORD_SIZE + old_entries[i].length;
+    }
+    free(old_entries);
+    free(old_arena);
+    ftruncate(fd, Z_HEADER_SIZE);
+    for (int i = 0; i < z_count; i++)
+        z_write_record(fd, &z_entries[i]);
+}
+
+// records a visit of an absolute path
+void z_visit(const char *path) {
+    char file_path[4200];
+    if (!z_file_path(file_path, sizeof(file_path)))
+        return;
+    int length = strlen(path);
+    if (length == 0 || length > UINT16_MAX)
+        return;
+    int fd = open(file_path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+        return;
+    flock(fd, LOCK_EX);
+    struct stat st;
+    fstat(fd, &st);
+    if (!z_loaded || st.st_size != z_file_size ||
+            st.st_mtim.tv_sec != z_file_mtime.tv_sec || st.st_mtim.tv_nsec != z_file_mtime.tv_nsec) {
+        z_loaded = true;
+        z_load_fd(fd); // changed by another shell
+    }
+    if (st.st_size < Z_HEADER_SIZE) {
+        char header[Z_HEADER_SIZE] = Z_MAGIC;
+        pwrite(fd, header, Z_HEADER_SIZE, 0);
+        st.st_size = Z_HEADER_SIZE;
+    }
+    int idx = z_find(path, length);
+    if (idx == -1)
+        idx = z_add(path, length, 0, 0, st.st_size);
+    z_entries[idx].rank += 1;
+    z_entries[idx].time = time(NULL);
+    z_write_record(fd, &z_entries[idx]);
+    double total = 0;
+    for (int i = 0; i < z_count; i++)
+        total += z_entries[i].rank;
+    if (total > Z_MAX_TOTAL_RANK)
+        z_compact(fd);
+    z_remember_file_state(fd);
+    close(fd);
+}
+
+// rank weighted by the time since the last visit
+double z_frecency(const struct ZEntry *entry, uint32_t now) {
+    uint32_t dt = now - entry->time;
+    if (dt < 3600)
+        return entry->rank * 4;
+    if (dt < 86400)
+        return entry->rank * 2;
+    if (dt < 604800)
+        return entry->rank / 2;
+    return entry->rank / 4;
+}
+
+// returns true if terms appear in str in this order
+bool z_match_substrings(const char *str, char **terms, const int *lengths, int count) {
+    for (int i = 0; i < count; i++) {
+        str = strstr(str, terms[i]);
+        if (str == NULL)
+            return false;
+        str += lengths[i];
+    }
+    return true;
+}
+
+// returns true if characters of query appear in str in this order
+bool z_match_fuzzy(const char *str, const char *query) {
+    for (; *str != '\0' && *query != '\0'; str++)
+        query += *str == *query;
+    return *query == '\0';
+}
+
+struct ZMatch {
+    int idx;
+    double score;
+};
+
+int compare_z_matches(const void *a, const void *b) {
+    double diff = ((const struct ZMatch *)a)->score - ((const struct ZMatch *)b)->score;
+    return diff < 0 ? -1 : diff > 0;
+}
+
+// finds directories matching all terms (as substrings in this order), exact case
+// matches win over any case ones, fuzzy matching is used only if nothing matched
+// returns number of matches written into matches (allocated, unsorted)
+int z_query(char *const *query_terms, int count, struct ZMatch **matches) {
+    // terms belong to the caller's argv, empty ones are dropped from a copy
+    char *terms[max_word_count];
+    char *lower_terms[max_word_count];
+    int lengths[max_word_count];
+    uint64_t mask = 0, pair_mask = 0;
+    bool upper = false; // query has uppercase letters
+    int effective_count = 0;
+    for (int i = 0; i < count && effective_count < max_word_count; i++) {
+        if (query_terms[i][0] == '\0')
+            continue;
+        terms[effective_count] = query_terms[i];
+        lengths[effective_count] = strlen(query_terms[i]);
+        char *lower = lower_terms[effective_count] = strdup(query_terms[i]);
+        for (int j = 0; lower[j] != '\0'; j++) {
+            upper |= isupper(lower[j]);
+            lower[j] = tolower(lower[j]);
+            mask |= z_char_bit(lower[j]);
+            if (j > 0)
+                pair_mask |= z_pair_bit(lower[j - 1], lower[j]);
+        }
+        effective_count++;
+    }
+    count = effective_count;
+    *matches = malloc((z_count + 1) * sizeof(struct ZMatch));
+    bool *exact = malloc(z_count + 1);
+    uint32_t now = time(NULL);
+    int n = 0;
+    int exact_count = 0;
+    for (int i = 0; count > 0 && i < z_count; i++) {
+        if ((z_masks[i] & mask) != mask || (z_pair_masks[i] & pair_mask) != pair_mask)
+            continue;
+        const struct ZEntry *entry = &z_entries[i];
+        if (!z_match_substrings(z_lower_path(entry), lower_terms, lengths, count))
+            continue;
+        if (entry->mixed_case)
+            exact[n] = z_match_substrings(z_path(entry), terms, lengths, count);
+        else
+            exact[n] = !upper;
+        exact_count += exact[n];
+        (*matches)[n].idx = i;
+        (*matches)[n++].score = z_frecency(entry, now);
+    }
+    for (int i = 0; count == 0 && i < z_count; i++) {
+        (*matches)[n].idx = i;
+        (*matches)[n++].score = z_frecency(&z_entries[i], now);
+    }
+    if (exact_count > 0 && exact_count < n) {
+        int kept = 0;
+        for (int i = 0; i < n; i++) {
+            if (exact[i])
+                (*matches)[kept++] = (*matches)[i];
+        }
+        n = kept;
+    }
+    if (n == 0 && count > 0) {
+        char query[max_word_length];
+        query[0] = '\0';
+        for (int i = 0; i < count; i++)
+            strncat(query, lower_terms[i], sizeof(query) - strlen(query) - 1);
+        for (int i = 0; i < z_count; i++) {
+            if ((z_masks[i] & mask) == mask && z_match_fuzzy(z_lower_path(&z_entries[i]), query)) {
+                (*matches)[n].idx = i;
+                (*matches)[n++].score = z_frecency(&z_entries[i], now);
+            }
+        }
+    }
+    free(exact);
+    for (int i = 0; i < count; i++)
+        free(lower_terms[i]);
+    return n;
+}
+
+char last_cd_location[4096] = {'\0'};
+// changes cwd and notifies everything that depends on it
+// returns true on success, false on failure
+bool change_directory(const char *const target_location) {
+    char previous[4096];
+    if (getcwd(previous, sizeof(previous)) == NULL)
+        previous[0] = '\0';
+    if (chdir(target_location) == -1) {
+        fprintf(stderr, "%scd: The directory \"%s\" does not exist%s\n", FG_RED, target_location, RESET);
+        return false;
+    }
+    // update last_cd_location only on success
+    strcpy(last_cd_location, previous);
+    prompt_on_cd();
+    char current[4096];
+    if (getcwd(current, sizeof(current)) != NULL)
+        z_visit(current);
+    return true;
+}
+
+int cmd_cd(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "%stoo many arguments!%s\n", FG_RED, RESET);
+        return 1;
+    }
+    const char *target_location;
+
+    if (argc == 1)
+        target_location = getenv("HOME");
+    else {
+        if (strcmp(argv[1], "-") == 0) {
+            if (last_cd_location[0] == '\0')
+                return 0; // nowhere to go back to yet
+            target_location = last_cd_location;
+        } else if (strcmp(argv[1], "~") == 0)
+            target_location = getenv("HOME");
+        else
+            target_location = argv[1];
+    }
+    if (target_location == NULL) {
+        fprintf(stderr, "%scd: HOME is not set%s\n", FG_RED, RESET);
+        return 1;
+    }
+    char target_copy[4096];
+    snprintf(target_copy, sizeof(target_copy), "%s", target_location); // last_cd_location changes
+    return change_directory(target_copy) ? 0 : 1;
+}
+
+#define DIR_STACK_SIZE 64
+char *dir_stack[DIR_STACK_SIZE]; // dir_stack[dir_stack_top - 1] is the top
+int dir_stack_top = 0;
+
+int cmd_dirs(int argc, char **argv) {
+    bool verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        while (dir_stack_top > 0)
+            free(dir_stack[--dir_stack_top]);
+        return 0;
+    }
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        strcpy(cwd, "?");
+    if (verbose)
+        printf("%2d  ", 0);
+    printf("%s%s%s", C_PATH, cwd, RESET);
+    for (int i = dir_stack_top - 1; i >= 0; i--) {
+        if (verbose)
+            printf("\n%2d  %s", dir_stack_top - i, dir_stack[i]);
+        else
+            printf(" %s", dir_stack[i]);
+    }
+    printf("\n");
+    return 0;
+}
+
+int cmd_pushd(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "%stoo many arguments!%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (dir_stack_top == DIR_STACK_SIZE) {
+        fprintf(stderr, "%spushd: directory stack is full%s\n", FG_RED, RESET);
+        return 1;
+    }
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        fprintf(stderr, "%spushd: %s%s\n", FG_RED, strerror(errno), RESET);
+        return 1;
+    }
+    if (argc == 1) {
+        // swap cwd with the top of the stack
+        if (dir_stack_top == 0) {
+            fprintf(stderr, "%spushd: no other directory%s\n", FG_RED, RESET);
+            return 1;
+        }
+        char *top = dir_stack[dir_stack_top - 1];
+        if (!change_directory(top))
+            return 1;
+        dir_stack[dir_stack_top - 1] = strdup(cwd);
+        free(top);
+    } else if (change_directory(argv[1]))
+        dir_stack[dir_stack_top++] = strdup(cwd);
+    else
+        return 1;
+    return cmd_dirs(1, argv);
+}
+
+int cmd_popd() {
+    if (dir_stack_top == 0) {
+        fprintf(stderr, "%spopd: directory stack empty%s\n", FG_RED, RESET);
+        return 1;
+    }
+    char *top = dir_stack[--dir_stack_top];
+    if (!change_directory(top)) {
+        dir_stack_top++; // keep it
+        return 1;
+    }
+    free(top);
+    return cmd_dirs(1, NULL);
+}
+
+// z [-l] TERMS... - jump to the most frecent directory matching TERMS
+int cmd_z(int argc, char **argv) {
+    bool list = argc > 1 && strcmp(argv[1], "-l") == 0;
+    char **terms = argv + 1 + list;
+    int count = argc - 1 - list;
+    if (!list && count == 1) {
+        // a real path doesn't need the index
+        struct stat st;
+        if (stat(terms[0], &st) == 0 && S_ISDIR(st.st_mode) && strchr(terms[0], '/') != NULL) {
+            return change_directory(terms[0]) ? 0 : 1;
+        }
+    }
+    if (!z_loaded)
+        z_load();
+    struct ZMatch *matches;
+    int n = z_query(terms, count, &matches);
+    if (list || count == 0) {
+        qsort(matches, n, sizeof(struct ZMatch), compare_z_matches);
+        for (int i = max(0, n - 50); i < n; i++)
+            printf("%10.1f  %s\n", matches[i].score, z_path(&z_entries[matches[i].idx]));
+        free(matches);
+        return 0;
+    }
+    // best match that still exists
+    int status = 1;
+    while (true) {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            if (matches[i].score >= 0 && (best == -1 || matches[i].score > matches[best].score))
+                best = i;
+        }
+        if (best == -1) {
+            fprintf(stderr, "%sz: no match%s\n", FG_RED, RESET);
+            break;
+        }
+        struct stat st;
+        const char *path = z_path(&z_entries[matches[best].idx]);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            char target[4096];
+            snprintf(target, sizeof(target), "%s", path);
+            if (change_directory(target))
+                status = 0;
+            break;
+        }
+        matches[best].score = -1; // removed since
+    }
+    free(matches);
+    return status;
+}
+
+int cmd_type(int argc, char **argv) {
+    if (argc == 1) {
+        fprintf(stderr, "%sname a command!%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (argc > 2) {
+        fprintf(stderr, "%stoo many arguments!%s\n", FG_RED, RESET);
+        return 1;
+    }
+    // argc == 2
+    if (is_builtin(argv[1]))
+        printf("builtin\n");
+    else
+        printf("external\n");
+    return 0;
+}
+
+// for testing parsing
+int cmd_args(int argc, char **argv) {
+    printf("%d args:\n", argc);
+    for (int i = 0; i < argc; i++)
+        printf("%s\n", argv[i]);
+    return 0;
+}
+
+int cmd_help() {
+    printf("%smicroshell%s by Maciej Kowalski (481828), avaible commands:\n", BOLD, RESET);
+    printf("  %shelp%s - see this list of avaible commands\n", ITALIC, RESET);
+    printf("  %sexit%s - exit microshell\n", ITALIC, RESET);
+    printf("  %stype%s - see if command is external or a bulitin\n", ITALIC, RESET);
+    printf("  %scalc%s - evaluate an arithmetic expression (dodatkowa komenda powłoki #1)\n", ITALIC, RESET);
+    printf("    %scd%s - change working directory\n", ITALIC, RESET);
+    printf(" %spushd%s - push working directory on a stack and change it\n", ITALIC, RESET);
+    printf("  %spopd%s - change working directory to the one on top of the stack\n", ITALIC, RESET);
+    printf("  %sdirs%s - show the directory stack (-v numbered, -c clear)\n", ITALIC, RESET);
+    printf("     %sz%s - jump to the most frecent visited directory matching given words (-l list)\n", ITALIC, RESET);
+    printf("    %sps%s - list running processes (dodatkowa komenda powłoki #2)\n", ITALIC, RESET);
+    printf("  %stime%s - run a command and report its real, user and sys time\n", ITALIC, RESET);
+    printf(" %slimit%s - run a program with --mem, --time, --nofile limits, --cpu cores and --nice\n", ITALIC, RESET);
+    printf(" %sstats%s - show resource usage after every command (on|off)\n", ITALIC, RESET);
+    printf(" %strace%s - record latency spans (on|off|dump <file> in Chrome trace format)\n", ITALIC, RESET);
+    printf(" %swatch%s - run a command every -n seconds and show what changed (q to stop)\n", ITALIC, RESET);
+    printf("%srecord%s - record the session into a compressed ring file (on <file> [size]|off|list|play <file> [n])\n", ITALIC, RESET);
+    printf("  %scat ls wc echo pwd true false%s - run in the shell, unsupported flags run the programs\n", ITALIC, RESET);
+    printf("%shistory%s - list entered commands (--stats with their resource usage, --sort real|rss [N] the top N)\n", ITALIC, RESET);
+    printf("%sbajery:%s\n", BOLD, RESET);
+    printf("* pełna obsługa strzałek\n");
+    printf("* historia poleceń\n");
+    printf("* obsługa argumentów w cudzysłowach\n");
+    printf("* kolorowanie terminala\n");
+    return 0;
+}
+
+bool is_numeric(char *str) {
+    for (int i = 0; i < strlen(str); i++) {
+        if (!isdigit(str[i]))
+            return false;
+    }
+    return true;
+}
+
+// copies the value of field up to the end of its line into outbuff
+// returns true on success, false if the field is missing or cut off
+bool extract(const char * const content, const char * const field, char * outbuff, int size) {
+    const char *start = strstr(content, field);
+    if (start == NULL)
+        return false;
+    start += strlen(field);
+    const char *end = strchr(start, '\n');
+    if (end == NULL || end - start >= size)
+        return false;
+    int length = end - start;
+    memcpy(outbuff, start, length);
+    outbuff[length] = '\0';
+    return true;
+}
+
+struct PSTable {
+    int length;
+    char ***content;
+};
+
+void init_ps_table(struct PSTable *tab) {
+    tab->length = 0;
+    tab->content = malloc(4 * sizeof(char **));
+    for (int i = 0; i < 4; i++) {
+        tab->content[i] = malloc(1000 * sizeof(char *));
+        for (int j = 0; j < 1000; j++)
+            tab->content[i][j] = malloc(200);
+    }
+}
+
+void append_ps_table(struct PSTable *tab, char *col0, char *col1, char *col2, char *col3) {
+    strcpy(tab->content[0][tab->length], col0);
+    strcpy(tab->content[1][tab->length], col1);
+    strcpy(tab->content[2][tab->length], col2);
+    strcpy(tab->content[3][tab->length], col3);
+    tab->length++;
+}
+
+int longest_len(char *column[], int n) {
+    int out = 0;
+    for (int i = 0; i < n; i++) {
+        int len = strlen(column[i]);
+        if (len > out)
+            out = len;
+    }
+    return out;
+}
+
+void print_ps_table(struct PSTable *tab) {
+    // column lengths
+    int col_w0 = longest_len(tab->content[0], tab->length);
+    int col_w1 = longest_len(tab->content[1], tab->length);
+    int col_w2 = longest_len(tab->content[2], tab->length);
+    int col_w3 = longest_len(tab->content[3], tab->length);
+    for (int i = 0; i < tab->length; i++) {
+        char color_es[50]; // color escape code
+        strcpy(color_es, RESET);
+        // skip header
+        if (i > 0) {
+            // get first letter of STATE column
+            char state = tab->content[3][i][0];
+            // possible values: R, I, S
+            // R - running
+            // I - idle
+            // S - sleeping
+            switch (state) {
+                case 'R':
+                    strcpy(color_es, PS_RUNNING);
+                    break;
+                case 'I':
+                    strcpy(color_es, PS_IDLE);
+                    break;
+                case 'S':
+                    strcpy(color_es, PS_SLEEPING);
+                    break;
+            }
+        }
+        char format[1000];
+        sprintf(format, "%%%ds  %%%ds  %%-%ds  %s%%-%ds%s\n",
+                col_w0, col_w1, col_w2, color_es, col_w3, RESET);
+        printf(format,
+                tab->content[0][i],
+                tab->content[1][i],
+                tab->content[2][i],
+                tab->content[3][i]);
+    }
+}
+
+void free_ps_table(struct PSTable *tab) {
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 1000; j++)
+            free(tab->content[i][j]);
+        free(tab->content[i]);
+    }
+    free(tab->content);
+}
+
+int cmd_ps() {
+    DIR *proc_dir = opendir("/proc");
+    if (proc_dir == NULL) {
+        fprintf(stderr, "%sps: /proc: %s%s\n", FG_RED, strerror(errno), RESET);
+        return 1;
+    }
+    struct dirent *entry;
+    struct PSTable tab;
+    init_ps_table(&tab);
+    append_ps_table(&tab, "PID", "PPID", "NAME", "STATE");
+    while ((entry = readdir(proc_dir)) != NULL) {
+        if (is_numeric(entry->d_name)) {
+            char status_path[1000];
+            sprintf(status_path, "/proc/%s/status", entry->d_name);
+            // the process may be gone by now, its entry is skipped then
+            int status_fd = open(status_path, O_RDONLY);
+            if (status_fd == -1)
+                continue;
+            char file_content[1000];
+            ssize_t length = read(status_fd, file_content, sizeof(file_content) - 1);
+            close(status_fd);
+            if (length <= 0)
+                continue;
+            file_content[length] = '\0';
+
+            char name[200], pid[200], ppid[200], state[200];
+            if (!extract(file_content, "Name:\t", name, sizeof(name)) ||
+                    !extract(file_content, "Pid:\t", pid, sizeof(pid)) ||
+                    !extract(file_content, "PPid:\t", ppid, sizeof(ppid)) ||
+                    !extract(file_content, "State:\t", state, sizeof(state)))
+                continue;
+
+            append_ps_table(&tab, pid, ppid, name, state);
+        }
+    }
+    print_ps_table(&tab);
+    free_ps_table(&tab);
+    closedir(proc_dir);
+    return 0;
+}
+
+const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// decimal number split into parts: value = mantissa * 10^exp10
+struct DecimalParts {
+    bool negative;
+    uint64_t mantissa; // first 19 significant digits
+    int exp10;
+    bool truncated; // true if nonzero digits didn't fit into mantissa
+    bool fraction; // true if there was a dot or an exponent
+};
+
+// scans a decimal number from [str, end), returns pointer to the first character
+// after the number or NULL if there is no number
+// With separators, '_' is allowed between two digits (1_000_000).
+const char *scan_decimal(const char *str, const char *end, bool separators, struct DecimalParts *parts) {
+    const char *p = str;
+    parts->negative = false;
+    parts->mantissa = 0;
+    parts->exp10 = 0;
+    parts->truncated = false;
+    parts->fraction = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        parts->negative = *p++ == '-';
+    int digits = 0; // significant digits in mantissa
+    bool any_digit = false;
+    bool after_dot = false;
+    for (; p < end; p++) {
+        if (isdigit(*p)) {
+            any_digit = true;
+            int d = *p - '0';
+            if (digits < 19) {
+                parts->mantissa = parts->mantissa * 10 + d;
+                if (parts->mantissa != 0)
+                    digits++;
+                if (after_dot)
+                    parts->exp10--;
+            } else {
+                if (!after_dot)
+                    parts->exp10++;
+                parts->truncated |= d != 0;
+            }
+        } else if (*p == '.' && !after_dot) {
+            after_dot = true;
+            parts->fraction = true;
+        } else if (separators && *p == '_' && p > str && isdigit(p[-1]) && p + 1 < end && isdigit(p[1]))
+            ; // digit separator
+        else
+            break;
+    }
+    if (!any_digit)
+        return NULL;
+    if (p + 1 < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool exp_negative = false;
+        if (*q == '-' || *q == '+')
+            exp_negative = *q++ == '-';
+        if (q < end && isdigit(*q)) {
+            int exp = 0;
+            for (; q < end && isdigit(*q); q++) {
+                if (exp < 100000)
+                    exp = exp * 10 + (*q - '0');
+            }
+            parts->exp10 += exp_negative ? -exp : exp;
+            parts->fraction = true;
+            p = q;
+        }
+    }
+    return p;
+}
+
+// Eisel-Lemire: converts w * 10^q into the nearest double using a 128-bit
+// approximation of 5^q, see https://arxiv.org/abs/2101.11408
+// returns false in the rare cases when the approximation is not precise enough
+bool eisel_lemire(uint64_t w, int q, double *out) {
+    if (w == 0 || q < POWERS_OF_FIVE_MIN) {
+        *out = 0;
+        return true;
+    }
+    if (q > POWERS_OF_FIVE_MAX) {
+        *out = INFINITY;
+        return true;
+    }
+    int lz = __builtin_clzll(w);
+    w <<= lz;
+    int index = 2 * (q - POWERS_OF_FIVE_MIN);
+    unsigned __int128 product = (unsigned __int128)w * powers_of_five[index];
+    uint64_t high = product >> 64;
+    uint64_t low = (uint64_t)product;
+    const uint64_t precision_mask = 0xFFFFFFFFFFFFFFFFULL >> 55; // 52 bits + 3 for rounding
+    if ((high & precision_mask) == precision_mask) {
+        unsigned __int128 second = (unsigned __int128)w * powers_of_five[index + 1];
+        uint64_t second_high = second >> 64;
+        low += second_high;
+        if (second_high > low)
+            high++;
+        if ((high & precision_mask) == precision_mask && low + 1 == 0 && (q < -27 || q > 55))
+            return false;
+    }
+    int upperbit = high >> 63;
+    uint64_t mantissa = high >> (upperbit + 64 - 52 - 3);
+    // 217706 / 2^16 ~ log2(10)
+    int power2 = ((217706 * q) >> 16) + 63 + upperbit - lz + 1023;
+    if (power2 <= 0) { // subnormal
+        if (-power2 + 1 >= 64) {
+            *out = 0;
+            return true;
+        }
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        power2 = mantissa < (1ULL << 52) ? 0 : 1;
+    } else {
+        // exactly halfway between two doubles - round to even
+        if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 &&
+                (mantissa << (upperbit + 64 - 52 - 3)) == high)
+            mantissa &= ~1ULL;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        if (mantissa >= (2ULL << 52)) {
+            mantissa = 1ULL << 52;
+            power2++;
+        }
+        mantissa &= ~(1ULL << 52);
+        if (power2 >= 0x7FF) {
+            *out = INFINITY;
+            return true;
+        }
+    }
+    uint64_t bits = mantissa | (uint64_t)power2 << 52;
+    memcpy(out, &bits, sizeof(bits));
+    return true;
+}
+
+// returns false if the number can't be converted without a slow fallback
+bool decimal_to_double(const struct DecimalParts *parts, double *out) {
+    double value;
+    if (parts->mantissa == 0)
+        value = 0;
+    else if (!parts->truncated && parts->mantissa <= (1ULL << 53) &&
+            parts->exp10 >= -22 && parts->exp10 <= 22) {
+        // both operands are exact, so the result is correctly rounded
+        value = (double)parts->mantissa;
+        if (parts->exp10 < 0)
+            value /= exact_powers_of_ten[-parts->exp10];
+        else
+            value *= exact_powers_of_ten[parts->exp10];
+    } else {
+        if (!eisel_lemire(parts->mantissa, parts->exp10, &value))
+            return false;
+        // the real value lies between mantissa and mantissa + 1
+        double upper;
+        if (parts->truncated &&
+                (!eisel_lemire(parts->mantissa + 1, parts->exp10, &upper) || upper != value))
+            return false;
+    }
+    *out = parts->negative ? -value : value;
+    return true;
+}
+
+// parses a decimal floating point number from [str, end), returns pointer to
+// the first character after the number or NULL if there is no number
+const char *parse_number(const char *str, const char *end, double *out) {
+    struct DecimalParts parts;
+    const char *p = scan_decimal(str, end, false, &parts);
+    if (p == NULL)
+        return NULL;
+    if (!decimal_to_double(&parts, out)) {
+        char tmp[512];
+        if (p - str >= (long)sizeof(tmp))
+            return NULL;
+        memcpy(tmp, str, p - str);
+        tmp[p - str] = '\0';
+        *out = strtod(tmp, NULL);
+    }
+    return p;
+}
+
+// numeric literal of calc expressions
+struct CalcLiteral {
+    double value;
+    bool exact; // true if the literal is an integer that fits in integer
+    __int128 integer;
+};
+
+// returns false on overflow
+bool mul_int128(__int128 a, __int128 b, __int128 *out) {
+    return !__builtin_mul_overflow(a, b, out);
+}
+
+// parses a numeric literal of calc expressions from [str, end): decimal (1.5, 1e-9),
+// hexadecimal (0x1F), with digit separators (1_000_000) and SI suffixes (k, M, G, T,
+// Ki, Mi, Gi, Ti), returns pointer to the first character after it or NULL on error
+const char *parse_literal(const char *str, const char *end, struct CalcLiteral *out) {
+    const char *p = str;
+    out->exact = false;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && isxdigit(p[2])) {
+        unsigned __int128 integer = 0;
+        bool overflow = false;
+        double value = 0;
+        for (p += 2; p < end; p++) {
+            if (*p == '_' && isxdigit(p[-1]) && p + 1 < end && isxdigit(p[1]))
+                continue;
+            if (!isxdigit(*p))
+                break;
+            int d = isdigit(*p) ? *p - '0' : tolower(*p) - 'a' + 10;
+            overflow |= integer >> 124 != 0;
+            integer = integer * 16 + d;
+            value = value * 16 + d;
+        }
+        out->value = overflow ? value : (double)integer;
+        out->exact = !overflow && integer >> 127 == 0;
+        out->integer = integer;
+    } else {
+        struct DecimalParts parts;
+        p = scan_decimal(str, end, true, &parts);
+        if (p == NULL)
+            return NULL;
+        const char *number_end = p;
+        // SI suffix
+        int suffix_exp10 = 0;
+        int suffix_exp2 = 0;
+        const char *units = "kMGT";
+        const char *unit = p < end && *p != '\0' ? strchr(units, *p == 'K' ? 'k' : *p) : NULL;
+        if (unit != NULL) {
+            if (p + 1 < end && p[1] == 'i') {
+                suffix_exp2 = 10 * (unit - units + 1);
+                p += 2;
+            } else {
+                suffix_exp10 = 3 * (unit - units + 1);
+                p++;
+            }
+        }
+        parts.exp10 += suffix_exp10;
+        if (!decimal_to_double(&parts, &out->value)) {
+            char tmp[512];
+            int length = 0;
+            for (const char *q = str; q < number_end && length < (int)sizeof(tmp) - 1; q++) {
+                if (*q != '_')
+                    tmp[length++] = *q;
+            }
+            tmp[length] = '\0';
+            out->value = strtod(tmp, NULL) * exact_powers_of_ten[suffix_exp10];
+        }
+        out->value = ldexp(out->value, suffix_exp2);
+        // exact integer value: mantissa * 10^exp10 * 2^suffix_exp2
+        if (!parts.fraction) {
+            // integer literals may be longer than the mantissa, collect all digits
+            __int128 integer = 0;
+            bool ok = true;
+            for (const char *q = str; q < number_end && ok; q++) {
+                if (isdigit(*q))
+                    ok = mul_int128(integer, 10, &integer) && !__builtin_add_overflow(integer, *q - '0', &integer);
+            }
+            for (int i = 0; i < suffix_exp10 && ok; i++)
+                ok = mul_int128(integer, 10, &integer);
+            ok = ok && mul_int128(integer, (__int128)1 << suffix_exp2, &integer);
+            out->exact = ok;
+            out->integer = parts.negative ? -integer : integer;
+        } else if (parts.mantissa == 0) {
+            out->exact = true;
+            out->integer = 0;
+        } else if (!parts.truncated && parts.exp10 >= -40 && parts.exp10 <= 38) {
+            __int128 integer = parts.mantissa;
+            bool ok = true;
+            for (int i = 0; i < parts.exp10 && ok; i++)
+                ok = mul_int128(integer, 10, &integer);
+            ok = ok && mul_int128(integer, (__int128)1 << suffix_exp2, &integer);
+            for (int i = parts.exp10; i < 0 && ok; i++) {
+                ok = integer % 10 == 0;
+                integer /= 10;
+            }
+            out->exact = ok;
+            out->integer = parts.negative ? -integer : integer;
+        }
+    }
+    // literal can't be followed by a letter, e.g. 12x or 3kB
+    if (p < end && (isalnum(*p) || *p == '_' || *p == '.'))
+        return NULL;
+    return p;
+}
+
+// prints expression with a caret under position pos
+void print_expression_error(const char *const message, const char *const expression, int pos) {
+    fprintf(stderr, "%s%s\n", FG_RED, message);
+    fprintf(stderr, "%s\n", expression);
+    for (int j = 0; j < pos; j++)
+        fprintf(stderr, " ");
+    fprintf(stderr, "^%s\n", RESET);
+}
+
+struct MathToken {
+    double value;
+    bool exact; // true if integer holds the exact value
+    __int128 integer;
+    char operation; // '+', '-', '*', '/', '^', '\0' - for value tokens
+    int nesting_level;
+};
+
+int operation_priority(struct MathToken *token) {
+    int priority = token->nesting_level * 3;
+    if (token->operation == '+' || token->operation == '-')
+        priority += 0;
+    if (token->operation == '*' || token->operation == '/')
+        priority += 1;
+    if (token->operation == '^')
+        priority += 2;
+    return priority;
+}
+
+void push_value_token(struct MathToken *tokens, int *size, const struct CalcLiteral *literal, int nesting_level) {
+    tokens[*size].operation = '\0';
+    tokens[*size].value = literal->value;
+    tokens[*size].exact = literal->exact;
+    tokens[*size].integer = literal->integer;
+    tokens[*size].nesting_level = nesting_level;
+    (*size)++;
+}
+
+void push_operation_token(struct MathToken *tokens, int *size, char operation, int nesting_level) {
+    tokens[*size].operation = operation;
+    tokens[*size].value = -2137.;
+    tokens[*size].exact = false;
+    tokens[*size].nesting_level = nesting_level;
+    (*size)++;
+}
+
+// [from, to] inclusive
+void replace_tokens(struct MathToken *tokens, int *size, int from, int to, const struct MathToken * const new_token) {
+    int removed_count = to - from + 1;
+    int shift = removed_count - 1;
+    // shift tokens [to + 1, size - 1] by `shift` to left
+    for (int i = to + 1; i < *size; i++)
+        memcpy(tokens + i - shift, tokens + i, sizeof(struct MathToken));
+    // insert copy of new token into correct position
+    memcpy(tokens + from, new_token, sizeof(struct MathToken));
+
+    // adjuest size
+    *size -= removed_count;
+    (*size)++; // one new was added
+}
+
+
+// isdigit extened by '.' for parsing floating point numbers
+bool isdigitx(char c) {
+    return isdigit(c) || c == '.';
+}
+
+bool is_digits_buffer_zero(const char * const db) {
+    for (int i = 0; db[i] != '\0'; i++) {
+        if (db[i] != '0' && db[i] != '.')
+            return false;
+    }
+    return true;
+}
+
+// returns true on success, false on failure
+// g is the integer version of f, used while both operands are exact
+bool perform_token2(struct MathToken *tokens, int *size, int oper_idx, double (*f)(double, double),
+        bool (*g)(__int128, __int128, __int128 *)) {
+    if (oper_idx == 0 || oper_idx == *size - 1) {
+        fprintf(stderr, "%sError #1: missing operand%s\n", FG_RED, RESET);
+        return false;
+    }
+    struct MathToken *lop = &tokens[oper_idx - 1]; // left operand
+    struct MathToken *rop = &tokens[oper_idx + 1]; // right operand
+    if (lop->nesting_level != tokens[oper_idx].nesting_level ||
+            rop->nesting_level != tokens[oper_idx].nesting_level) {
+        fprintf(stderr, "%sError #2: wrong nesting level of operands%s\n", FG_RED, RESET);
+        return false;
+    }
+    if (lop->operation != '\0' || rop->operation != '\0') {
+        fprintf(stderr, "%sError #3: wrong operands%s\n", FG_RED, RESET);
+        return false;
+    }
+    // replace tokens oper_idx-1, oper_idx, oper_idx+1 with new result token
+    struct MathToken result;
+    result.exact = lop->exact && rop->exact && g(lop->integer, rop->integer, &result.integer);
+    if (result.exact)
+        result.value = (double)result.integer;
+    else
+        result.value = f(lop->value, rop->value);
+    result.operation = '\0';
+    // set nesting level of result to the highest nesting level of neigboring tokens
+    // After addition those tokens are token[oper_idx - 2] and token[oper_idx + 2].
+    int left_nl = 0;
+    if (oper_idx - 2 >= 0)
+        left_nl = tokens[oper_idx - 2].nesting_level;
+    int right_nl = 0;
+    if (oper_idx + 2 < *size)
+        left_nl = tokens[oper_idx + 2].nesting_level;
+    int nl = max(left_nl, right_nl);
+    result.nesting_level = nl;
+    replace_tokens(tokens, size, oper_idx - 1, oper_idx + 1, &result);
+    return true;
+}
+
+// returns true on success, false on failure
+bool perform_token1(struct MathToken *tokens, int *size, int oper_idx, double (*f)(double),
+        bool (*g)(__int128, __int128 *)) {
+    // make sure there is a token on the right
+    if (oper_idx == *size - 1) {
+        fprintf(stderr, "%sError #1: missing operand%s\n", FG_RED, RESET);
+        return false;
+    }
+    // make sure token on the right is a number with same nesting level
+    if (tokens[oper_idx + 1].operation != '\0' ||
+        tokens[oper_idx + 1].nesting_level != tokens[oper_idx].nesting_level) {
+        fprintf(stderr, "%sError #2: wrong operand%s\n", FG_RED, RESET);
+        return false;
+    }
+    struct MathToken *rop = &tokens[oper_idx + 1]; // right operand
+    // replace tokens oper_idx, oper_idx, oper_idx+1 with new result token
+    struct MathToken result;
+    result.exact = rop->exact && g(rop->integer, &result.integer);
+    if (result.exact)
+        result.value = (double)result.integer;
+    else
+        result.value = f(rop->value);
+    result.operation = '\0';
+    // set nesting level of result to the highest nesting level of neigboring tokens
+    // After addition those tokens are token[oper_idx - 2] and token[oper_idx + 2].
+    int left_nl = 0;
+    if (oper_idx - 2 >= 0)
+        left_nl = tokens[oper_idx - 2].nesting_level;
+    int right_nl = 0;
+    if (oper_idx + 2 < *size)
+        left_nl = tokens[oper_idx + 2].nesting_level;
+    int nl = max(left_nl, right_nl);
+    result.nesting_level = nl;
+    replace_tokens(tokens, size, oper_idx, oper_idx + 1, &result);
+    return true;
+}
+
+double op_addition(double a, double b) {
+    return a + b;
+}
+
+double op_subtraction(double a, double b) {
+    return a - b;
+}
+
+double op_opposite(double a) {
+    return -a;
+}
+
+double op_multiplication(double a, double b) {
+    return a * b;
+}
+
+double op_division(double a, double b) {
+    return a / b;
+}
+
+double op_exponentiation(double a, double b) {
+    return pow(a, b);
+}
+
+// Integer versions of operations, used while all operands are exact integers.
+// They return false when the result is not an integer or doesn't fit in 128 bits,
+// in the latter case calc_integer_overflow is set.
+bool calc_integer_overflow = false;
+const __int128 int128_min = (__int128)((unsigned __int128)1 << 127);
+
+bool iop_addition(__int128 a, __int128 b, __int128 *out) {
+    bool overflow = __builtin_add_overflow(a, b, out);
+    calc_integer_overflow |= overflow;
+    return !overflow;
+}
+
+bool iop_subtraction(__int128 a, __int128 b, __int128 *out) {
+    bool overflow = __builtin_sub_overflow(a, b, out);
+    calc_integer_overflow |= overflow;
+    return !overflow;
+}
+
+bool iop_opposite(__int128 a, __int128 *out) {
+    if (a == int128_min) {
+        calc_integer_overflow = true;
+        return false;
+    }
+    *out = -a;
+    return true;
+}
+
+bool iop_multiplication(__int128 a, __int128 b, __int128 *out) {
+    bool overflow = __builtin_mul_overflow(a, b, out);
+    calc_integer_overflow |= overflow;
+    return !overflow;
+}
+
+bool iop_division(__int128 a, __int128 b, __int128 *out) {
+    if (b == 0 || (a == int128_min && b == -1) || a % b != 0)
+        return false;
+    *out = a / b;
+    return true;
+}
+
+bool iop_exponentiation(__int128 a, __int128 b, __int128 *out) {
+    if (b < 0)
+        return false;
+    __int128 result = 1;
+    while (b > 0) {
+        if (b & 1 && !iop_multiplication(result, a, &result))
+            return false;
+        b >>= 1;
+        if (b > 0 && !iop_multiplication(a, a, &a))
+            return false;
+    }
+    *out = result;
+    return true;
+}
+
+// writes value into out, returns number of characters written
+int format_int128(__int128 value, char *out) {
+    char digits[40];
+    int n = 0;
+    unsigned __int128 magnitude = value < 0 ? -(unsigned __int128)value : (unsigned __int128)value;
+    do {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    int length = 0;
+    if (value < 0)
+        out[length++] = '-';
+    while (n > 0)
+        out[length++] = digits[--n];
+    out[length] = '\0';
+    return length;
+}
+
+int calc_columns(int argc, char **argv);
+int calc_format(double value, char *out);
+int cmd_calc(int argc, char **argv) {
+    if (argc == 1) {
+        fprintf(stderr, "%sprovide expression, e.g. (2 + 2) * 8%s\n", FG_RED, RESET);
+        printf("supported operations:\n");
+        printf("  + - addtion\n");
+        printf("  - - subtraction\n");
+        printf("  * - multiplication\n");
+        printf("  / - division\n");
+        printf("  ^ - exponentiation\n");
+        printf("numbers: 1.5, 1e-9, 0x1F, 1_000_000, SI suffixes k M G T and Ki Mi Gi Ti (4Ki = 4096)\n");
+        printf("integer expressions are computed exactly (up to 128 bits)\n");
+        printf("column mode:\n");
+        printf("  calc -x EXPR [-c NAMES] [-a AGGREGATES] [FILE]\n");
+        printf("  -x - expression evaluated for every row, e.g. 'x * 1.5 + 2'\n");
+        printf("  -c - comma separated column names (default: x), _ skips a column\n");
+        printf("  -a - print only sum, min, max, mean and/or count of the results\n");
+        return 1;
+    }
+    if (strcmp(argv[1], "-x") == 0 || strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "-a") == 0) {
+        return calc_columns(argc, argv);
+    }
+    // merge argv into expression
+    char expression[1000];
+    int idx = 0;
+    for (int i = 1; i < argc; i++) {
+        strcpy(expression + idx, argv[i]);
+        idx += strlen(argv[i]);
+    }
+    // remove whitespace
+    int lgc = -1; // index of last graphic character
+    for (int i = 0; i < strlen(expression); i++) {
+        if (isgraph(expression[i]))
+            expression[++lgc] = expression[i];
+    }
+    expression[lgc + 1] = '\0';
+    // replace ',' with '.'
+    for (int i = 0; i < strlen(expression); i++) {
+        if (expression[i] == ',')
+            expression[i] = '.';
+    }
+    // check characters (letters and '_' may be a part of a number, e.g. 0x1F, 1e-9, 1_000 or 4Ki)
+    for (int i = 0; i < strlen(expression); i++) {
+        if (!isalnum(expression[i]) &&
+                expression[i] != '_' &&
+                expression[i] != '+' &&
+                expression[i] != '-' &&
+                expression[i] != '*' &&
+                expression[i] != '/' &&
+                expression[i] != '^' &&
+                expression[i] != '(' &&
+                expression[i] != ')' &&
+                expression[i] != '.') {
+            fprintf(stderr, "%sinvalid character %c\n", FG_RED, expression[i]);
+            fprintf(stderr, "%s\n", expression);
+            for(int j = 0; j < i; j++)
+                fprintf(stderr, " ");
+            fprintf(stderr, "^%s\n", RESET);
+            return 1;
+        }
+    }
+    // check parenthesis
+    int open_count = 0;
+    for (int i = 0; i < strlen(expression); i++) {
+        if (expression[i] == '(')
+            open_count++;
+        if (expression[i] == ')')
+            open_count--;
+        if (open_count < 0) {
+            fprintf(stderr, "%smissing opening bracket\n", FG_RED);
+            fprintf(stderr, "%s\n", expression);
+            for (int j = 0; j < i; j++)
+                fprintf(stderr, " ");
+            fprintf(stderr, "^%s\n", RESET);
+            return 1;
+        }
+    }
+    if (open_count > 0) {
+        fprintf(stderr, "%sError: missing closing bracket%s\n", FG_RED, RESET);
+        return 1;
+    }
+    // a captured result, e.g. $(calc 1+1), is only the bare value
+    bool terminal = stdout_is_terminal();
+    if (terminal)
+        printf("%s = ?\n", expression);
+    calc_integer_overflow = false;
+    // tokenize
+    struct MathToken tokens[1000];
+    int tokens_size = 0;
+    int nesting_level = 0;
+    int length = strlen(expression);
+    for (int i = 0; i < length; i++) {
+        if (isdigitx(expression[i])) {
+            struct CalcLiteral literal;
+            const char *end = parse_literal(expression + i, expression + length, &literal);
+            if (end == NULL) {
+                print_expression_error("couldn't parse number", expression, i);
+                return 1;
+            }
+            push_value_token(tokens, &tokens_size, &literal, nesting_level);
+            i = end - expression - 1;
+        } else if (expression[i] == '(')
+            nesting_level++;
+        else if (expression[i] == ')')
+            nesting_level--;
+        else if (isalpha(expression[i]) || expression[i] == '_') {
+            print_expression_error("invalid character", expression, i);
+            return 1;
+        } else
+            push_operation_token(tokens, &tokens_size, expression[i], nesting_level);
+    }
+    // evaluate expression
+    while (tokens_size > 1) {
+        // find operation with highest priority, the leftmost one except for
+        // '^' which is right associative as in column mode
+        int highest_priority = -1;
+        int oper_idx = -1;
+        for (int i = 0; i < tokens_size; i++) {
+            if (tokens[i].operation != '\0') {
+                int op = operation_priority(&tokens[i]);
+                if (op > highest_priority || (op == highest_priority && tokens[i].operation == '^')) {
+                    highest_priority = op;
+                    oper_idx = i;
+                }
+            }
+
+        }
+        if (oper_idx == -1) {
+            fprintf(stderr, "%sError: no operations%s\n", FG_RED, RESET);
+            return 1;
+        }
+        // perform operation
+        bool succ = false;
+        switch (tokens[oper_idx].operation) {
+            case '+': {
+                succ = perform_token2(tokens, &tokens_size, oper_idx, op_addition, iop_addition);
+                break;
+            }
+            case '-': {
+                // is token on left a number
+                if (oper_idx > 0 && tokens[oper_idx - 1].operation == '\0' &&
+                    tokens[oper_idx - 1].nesting_level == tokens[oper_idx].nesting_level)
+                    succ = perform_token2(tokens, &tokens_size, oper_idx, op_subtraction, iop_subtraction);
+                else
+                    succ = perform_token1(tokens, &tokens_size, oper_idx, op_opposite, iop_opposite);
+                break;
+            }
+            case '*': {
+                succ = perform_token2(tokens, &tokens_size, oper_idx, op_multiplication, iop_multiplication);
+                break;
+            }
+            case '/': {
+                succ = perform_token2(tokens, &tokens_size, oper_idx, op_division, iop_division);
+                break;
+            }
+            case '^': {
+                succ = perform_token2(tokens, &tokens_size, oper_idx, op_exponentiation, iop_exponentiation);
+                break;
+            }
+        }
+        if (!succ) {
+            fprintf(stderr, "%sError: operation failed%s\n", FG_RED, RESET);
+            return 1;
+        }
+    }
+    // print results
+    if (tokens[0].exact) {
+        char integer[50];
+        format_int128(tokens[0].integer, integer);
+        printf("%s%s%s\n", terminal ? FG_GREEN : "", integer, terminal ? RESET : "");
+    } else {
+        char value[64];
+        value[calc_format(tokens[0].value, value)] = '\0';
+        printf("%s%s%s\n", terminal ? FG_GREEN : "", value, terminal ? RESET : "");
+        fflush(stdout);
+        if (calc_integer_overflow)
+            fprintf(stderr, "%swarning: integer overflow, the result is not exact%s\n", FG_YELLOW, RESET);
+    }
+    return 0;
+}
+
+// calc column mode: `calc -x EXPR [-c NAMES] [-a AGGREGATES] [FILE]`
+// Rows of numbers are read from FILE (or stdin) in large blocks, EXPR is compiled
+// once into a small stack program and evaluated over batches of rows, so every
+// instruction is a tight loop over an array that the compiler can vectorize.
+
+#define CALC_BATCH 1024 // rows evaluated at once
+#define CALC_BLOCK_SIZE (1 << 20) // input is read in blocks of this size
+#define CALC_OUT_SIZE (1 << 16)
+#define CALC_MAX_COLUMNS 32
+#define CALC_MAX_PROGRAM 512
+#define CALC_MAX_STACK 64
+
+enum CalcOpcode {
+    CALC_CONST,
+    CALC_COLUMN,
+    CALC_ADD,
+    CALC_SUB,
+    CALC_MUL,
+    CALC_DIV,
+    CALC_POW,
+    CALC_NEG
+};
+
+struct CalcInstruction {
+    enum CalcOpcode opcode;
+    double value; // for CALC_CONST
+    int column; // for CALC_COLUMN
+};
+
+struct CalcProgram {
+    struct CalcInstruction code[CALC_MAX_PROGRAM];
+    int size;
+};
+
+// fields of every input row; fields named "_" are skipped without parsing
+struct CalcColumns {
+    int count;
+    char names[CALC_MAX_COLUMNS][64];
+};
+
+struct CalcBatch {
+    double columns[CALC_MAX_COLUMNS][CALC_BATCH];
+    double stack[CALC_MAX_STACK][CALC_BATCH];
+};
+
+#define CALC_AGG_SUM 1
+#define CALC_AGG_MIN 2
+#define CALC_AGG_MAX 4
+#define CALC_AGG_MEAN 8
+#define CALC_AGG_COUNT 16
+
+struct CalcAggregates {
+    long long count;
+    double sum;
+    double min;
+    double max;
+};
+
+int calc_operator_priority(char operation) {
+    switch (operation) {
+        case '+':
+        case '-':
+            return 1;
+        case '*':
+        case '/':
+            return 2;
+        case '~': // unary minus
+            return 3;
+        case '^':
+            return 4;
+    }
+    return 0;
+}
+
+bool calc_is_binary(enum CalcOpcode opcode) {
+    return opcode != CALC_CONST && opcode != CALC_COLUMN && opcode != CALC_NEG;
+}
+
+double calc_apply(enum CalcOpcode opcode, double a, double b) {
+    switch (opcode) {
+        case CALC_ADD: return a + b;
+        case CALC_SUB: return a - b;
+        case CALC_MUL: return a * b;
+        case CALC_DIV: return a / b;
+        case CALC_POW: return pow(a, b);
+        case CALC_NEG: return -a;
+        default: return a;
+    }
+}
+
+// appends operator to the program, folding constant operands on the way
+bool calc_emit_operator(struct CalcProgram *program, char operation) {
+    enum CalcOpcode opcode;
+    switch (operation) {
+        case '+': opcode = CALC_ADD; break;
+        case '-': opcode = CALC_SUB; break;
+        case '*': opcode = CALC_MUL; break;
+        case '/': opcode = CALC_DIV; break;
+        case '^': opcode = CALC_POW; break;
+        default: opcode = CALC_NEG; break;
+    }
+    struct CalcInstruction *code = program->code;
+    int size = program->size;
+    if (opcode == CALC_NEG && size >= 1 && code[size - 1].opcode == CALC_CONST) {
+        code[size - 1].value = -code[size - 1].value;
+        return true;
+    }
+    if (opcode != CALC_NEG && size >= 2 &&
+            code[size - 1].opcode == CALC_CONST && code[size - 2].opcode == CALC_CONST) {
+        code[size - 2].value = calc_apply(opcode, code[size - 2].value, code[size - 1].value);
+        program->size--;
+        return true;
+    }
+    if (size == CALC_MAX_PROGRAM)
+        return false;
+    code[size].opcode = opcode;
+    program->size++;
+    return true;
+}
+
+// compiles infix expression into a stack program (shunting-yard)
+// returns true on success, false on failure
+bool calc_compile(const char *const expression, const struct CalcColumns *columns, struct CalcProgram *program) {
+    char operators[CALC_MAX_PROGRAM]; // '+', '-', '*', '/', '^', '~' (unary minus), '('
+    int operators_top = 0;
+    int n = strlen(expression);
+    bool expect_operand = true;
+    program->size = 0;
+    int i = 0;
+    while (i < n) {
+        char c = expression[i];
+        if (isspace(c)) {
+            i++;
+            continue;
+        }
+        if (operators_top == CALC_MAX_PROGRAM || program->size == CALC_MAX_PROGRAM) {
+            fprintf(stderr, "%sError: expression is too long%s\n", FG_RED, RESET);
+            return false;
+        }
+        if (expect_operand) {
+            if (isdigitx(c)) {
+                struct CalcLiteral literal;
+                const char *end = parse_literal(expression + i, expression + n, &literal);
+                if (end == NULL) {
+                    print_expression_error("invalid number", expression, i);
+                    return false;
+                }
+                program->code[program->size].opcode = CALC_CONST;
+                program->code[program->size++].value = literal.value;
+                i = end - expression;
+                expect_operand = false;
+            } else if (isalpha(c) || c == '_') {
+                int length = 0;
+                while (i + length < n && (isalnum(expression[i + length]) || expression[i + length] == '_'))
+                    length++;
+                int column = -1;
+                for (int j = 0; j < columns->count; j++) {
+                    if (strlen(columns->names[j]) == length &&
+                            strncmp(columns->names[j], expression + i, length) == 0 &&
+                            strcmp(columns->names[j], "_") != 0)
+                        column = j;
+                }
+                if (column == -1) {
+                    print_expression_error("unknown column", expression, i);
+                    return false;
+                }
+                program->code[program->size].opcode = CALC_COLUMN;
+                program->code[program->size++].column = column;
+                i += length;
+                expect_operand = false;
+            } else if (c == '-') {
+                operators[operators_top++] = '~';
+                i++;
+            } else if (c == '+') {
+                i++; // unary plus does nothing
+            } else if (c == '(') {
+                operators[operators_top++] = '(';
+                i++;
+            } else {
+                print_expression_error("missing operand", expression, i);
+                return false;
+            }
+        } else {
+            if (c == ')') {
+                while (operators_top > 0 && operators[operators_top - 1] != '(') {
+                    if (!calc_emit_operator(program, operators[--operators_top])) {
+                        fprintf(stderr, "%sError: expression is too long%s\n", FG_RED, RESET);
+                        return false;
+                    }
+                }
+                if (operators_top == 0) {
+                    print_expression_error("missing opening bracket", expression, i);
+                    return false;
+                }
+                operators_top--; // pop '('
+                i++;
+            } else if (c == '+' || c == '-' || c == '*' || c == '/' || c == '^') {
+                int priority = calc_operator_priority(c);
+                while (operators_top > 0 && operators[operators_top - 1] != '(') {
+                    int top_priority = calc_operator_priority(operators[operators_top - 1]);
+                    // '^' is right associative
+                    if (top_priority < priority || (top_priority == priority && c == '^'))
+                        break;
+                    if (!calc_emit_operator(program, operators[--operators_top])) {
+                        fprintf(stderr, "%sError: expression is too long%s\n", FG_RED, RESET);
+                        return false;
+                    }
+                }
+                operators[operators_top++] = c;
+                expect_operand = true;
+                i++;
+            } else {
+                print_expression_error("invalid character", expression, i);
+                return false;
+            }
+        }
+    }
+    if (expect_operand) {
+        print_expression_error("missing operand", expression, n);
+        return false;
+    }
+    while (operators_top > 0) {
+        char operation = operators[--operators_top];
+        if (operation == '(') {
+            fprintf(stderr, "%sError: missing closing bracket%s\n", FG_RED, RESET);
+            return false;
+        }
+        if (!calc_emit_operator(program, operation)) {
+            fprintf(stderr, "%sError: expression is too long%s\n", FG_RED, RESET);
+            return false;
+        }
+    }
+    // check stack usage
+    int depth = 0;
+    for (int j = 0; j < program->size; j++) {
+        enum CalcOpcode opcode = program->code[j].opcode;
+        if (opcode == CALC_CONST || opcode == CALC_COLUMN)
+            depth++;
+        else if (calc_is_binary(opcode))
+            depth--;
+        if (depth > CALC_MAX_STACK) {
+            fprintf(stderr, "%sError: expression is nested too deeply%s\n", FG_RED, RESET);
+            return false;
+        }
+    }
+    return true;
+}
+
+void calc_vector_op(enum CalcOpcode opcode, double *restrict a, const double *restrict b, int n) {
+    switch (opcode) {
+        case CALC_ADD:
+            for (int i = 0; i < n; i++)
+                a[i] += b[i];
+            break;
+        case CALC_SUB:
+            for (int i = 0; i < n; i++)
+                a[i] -= b[i];
+            break;
+        case CALC_MUL:
+            for (int i = 0; i < n; i++)
+                a[i] *= b[i];
+            break;
+        case CALC_DIV:
+            for (int i = 0; i < n; i++)
+                a[i] /= b[i];
+            break;
+        case CALC_POW:
+            for (int i = 0; i < n; i++)
+                a[i] = pow(a[i], b[i]);
+            break;
+        default:
+            break;
+    }
+}
+
+void calc_scalar_op(enum CalcOpcode opcode, double *restrict a, double b, int n) {
+    switch (opcode) {
+        case CALC_ADD:
+            for (int i = 0; i < n; i++)
+                a[i] += b;
+            break;
+        case CALC_SUB:
+            for (int i = 0; i < n; i++)
+                a[i] -= b;
+            break;
+        case CALC_MUL:
+            for (int i = 0; i < n; i++)
+                a[i] *= b;
+            break;
+        case CALC_DIV:
+            for (int i = 0; i < n; i++)
+                a[i] /= b;
+            break;
+        case CALC_POW:
+            if (b == 2) {
+                for (int i = 0; i < n; i++)
+                    a[i] *= a[i];
+            } else {
+                for (int i = 0; i < n; i++)
+                    a[i] = pow(a[i], b);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// evaluates program for the first n rows of the batch, results end up in stack[0]
+void calc_run(const struct CalcProgram *program, struct CalcBatch *batch, int n) {
+    int depth = 0;
+    for (int pc = 0; pc < program->size; pc++) {
+        const struct CalcInstruction *ins = &program->code[pc];
+        switch (ins->opcode) {
+            case CALC_CONST:
+                // constant right operand - no need to broadcast it
+                if (pc + 1 < program->size && calc_is_binary(program->code[pc + 1].opcode)) {
+                    calc_scalar_op(program->code[pc + 1].opcode, batch->stack[depth - 1], ins->value, n);
+                    pc++;
+                } else {
+                    for (int i = 0; i < n; i++)
+                        batch->stack[depth][i] = ins->value;
+                    depth++;
+                }
+                break;
+            case CALC_COLUMN:
+                memcpy(batch->stack[depth++], batch->columns[ins->column], n * sizeof(double));
+                break;
+            case CALC_NEG:
+                for (int i = 0; i < n; i++)
+                    batch->stack[depth - 1][i] = -batch->stack[depth - 1][i];
+                break;
+            default:
+                calc_vector_op(ins->opcode, batch->stack[depth - 2], batch->stack[depth - 1], n);
+                depth--;
+                break;
+        }
+    }
+}
+
+bool calc_is_separator(char c) {
+    return c == ' ' || c == '\t' || c == ',' || c == ';' || c == '\r';
+}
+
+// parses fields of [line, end) into given row of the batch
+// returns true on success, false on malformed row
+bool calc_parse_row(const char *line, const char *end, const struct CalcColumns *columns,
+        struct CalcBatch *batch, int row) {
+    const char *p = line;
+    for (int c = 0; c < columns->count; c++) {
+        while (p < end && calc_is_separator(*p))
+            p++;
+        if (p == end)
+            return false;
+        if (columns->names[c][0] == '_' && columns->names[c][1] == '\0') {
+            while (p < end && !calc_is_separator(*p))
+                p++;
+            continue;
+        }
+        p = parse_number(p, end, &batch->columns[c][row]);
+        if (p == NULL || (p < end && !calc_is_separator(*p)))
+            return false;
+    }
+    return true;
+}
+
+// writes the digits of integer into out, returns their number
+int calc_format_digits(unsigned long long integer, int min_digits, char *out) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + integer % 10;
+        integer /= 10;
+    } while (integer > 0 || n < min_digits);
+    for (int i = 0; i < n; i++)
+        out[i] = digits[n - 1 - i];
+    return n;
+}
+
+// writes value into out, returns number of characters written
+// The text is the shortest one that reads back as the same double. Values in
+// the range %g prints without an exponent are tried as m / 10^d for growing d:
+// with m below 2^53 and 10^d exact the division is correctly rounded, so if it
+// gives back the value, "m with d decimals" does too. Anything else (exponents,
+// 17 digit values) goes through sprintf.
+int calc_format(double value, char *out) {
+    double magnitude = fabs(value);
+    int length = 0;
+    if (value < 0)
+        out[length++] = '-';
+    if (magnitude < 1e15 && magnitude == trunc(magnitude))
+        return length + calc_format_digits((unsigned long long)magnitude, 1, out + length);
+    if (magnitude >= 1e-4 && magnitude < 1e15) {
+        for (int decimals = 1; decimals <= 17; decimals++) {
+            double scaled = magnitude * exact_powers_of_ten[decimals];
+            if (scaled >= 9007199254740992.0) // 2^53
+                break;
+            unsigned long long m = (unsigned long long)(scaled + 0.5);
+            if (m / exact_powers_of_ten[decimals] != magnitude)
+                continue;
+            char *digits = out + length;
+            int n = calc_format_digits(m, decimals + 1, digits);
+            memmove(digits + n - decimals + 1, digits + n - decimals, decimals);
+            digits[n - decimals] = '.';
+            return length + n + 1;
+        }
+    }
+    // shortest precision that reads back as the same value
+    for (int precision = 15; precision < 17; precision++) {
+        length = sprintf(out, "%.*g", precision, value);
+        if (!isfinite(value) || strtod(out, NULL) == value)
+            return length;
+    }
+    return sprintf(out, "%.17g", value); // always reads back
+}
+
+// consumes results of an evaluated batch
+void calc_output(const double *results, int n, int aggregates, struct CalcAggregates *agg,
+        char *out, int *out_size) {
+    if (aggregates != 0) {
+        double sum = 0;
+        for (int i = 0; i < n; i++)
+            sum += results[i];
+        agg->sum += sum;
+        for (int i = 0; i < n; i++) {
+            agg->min = fmin(agg->min, results[i]);
+            agg->max = fmax(agg->max, results[i]);
+        }
+        agg->count += n;
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (*out_size > CALC_OUT_SIZE - 64) {
+            fwrite(out, 1, *out_size, stdout);
+            *out_size = 0;
+        }
+        *out_size += calc_format(results[i], out + *out_size);
+        out[(*out_size)++] = '\n';
+    }
+}
+
+void print_aggregate(const char *const name, double value) {
+    char buff[64];
+    buff[calc_format(value, buff)] = '\0';
+    printf("%s%s%s = %s%s%s\n", BOLD, name, RESET, FG_GREEN, buff, RESET);
+}
+
+// returns true on success, false on failure
+bool calc_parse_columns(const char *spec, struct CalcColumns *columns) {
+    columns->count = 0;
+    const char *p = spec;
+    while (true) {
+        const char *comma = strchr(p, ',');
+        int length = comma == NULL ? strlen(p) : comma - p;
+        if (length == 0 || length >= sizeof(columns->names[0]) || columns->count == CALC_MAX_COLUMNS)
+            return false;
+        memcpy(columns->names[columns->count], p, length);
+        columns->names[columns->count++][length] = '\0';
+        if (comma == NULL)
+            return true;
+        p = comma + 1;
+    }
+}
+
+// returns true on success, false on failure
+bool calc_parse_aggregates(const char *spec, int *aggregates) {
+    char buff[1000];
+    if (strlen(spec) >= sizeof(buff))
+        return false;
+    strcpy(buff, spec);
+    for (char *name = strtok(buff, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (strcmp(name, "sum") == 0)
+            *aggregates |= CALC_AGG_SUM;
+        else if (strcmp(name, "min") == 0)
+            *aggregates |= CALC_AGG_MIN;
+        else if (strcmp(name, "max") == 0)
+            *aggregates |= CALC_AGG_MAX;
+        else if (strcmp(name, "mean") == 0 || strcmp(name, "avg") == 0)
+            *aggregates |= CALC_AGG_MEAN;
+        else if (strcmp(name, "count") == 0)
+            *aggregates |= CALC_AGG_COUNT;
+        else
+            return false;
+    }
+    return true;
+}
+
+int calc_columns(int argc, char **argv) {
+    const char *expression = NULL;
+    const char *path = NULL;
+    struct CalcColumns columns;
+    columns.count = 1;
+    strcpy(columns.names[0], "x");
+    int aggregates = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+            expression = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            if (!calc_parse_columns(argv[++i], &columns)) {
+                fprintf(stderr, "%scalc: invalid column list \"%s\"%s\n", FG_RED, argv[i], RESET);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            if (!calc_parse_aggregates(argv[++i], &aggregates)) {
+                fprintf(stderr, "%scalc: unknown aggregate in \"%s\" (sum, min, max, mean, count)%s\n",
+                        FG_RED, argv[i], RESET);
+                return 1;
+            }
+        } else if (path == NULL && argv[i][0] != '-')
+            path = argv[i];
+        else {
+            fprintf(stderr, "%scalc: unexpected argument \"%s\"%s\n", FG_RED, argv[i], RESET);
+            return 1;
+        }
+    }
+    if (expression == NULL) {
+        fprintf(stderr, "%scalc: column mode needs an expression (-x)%s\n", FG_RED, RESET);
+        return 1;
+    }
+    struct CalcProgram *program = malloc(sizeof(struct CalcProgram));
+    if (!calc_compile(expression, &columns, program)) {
+        free(program);
+        return 1;
+    }
+    int fd = STDIN_FILENO;
+    if (path != NULL) {
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "%scalc: %s: %s%s\n", FG_RED, path, strerror(errno), RESET);
+            free(program);
+            return 1;
+        }
+    }
+    struct CalcBatch *batch = malloc(sizeof(struct CalcBatch));
+    char *block = malloc(CALC_BLOCK_SIZE);
+    char *out = malloc(CALC_OUT_SIZE);
+    int out_size = 0;
+    struct CalcAggregates agg = {0, 0, INFINITY, -INFINITY};
+    long long line_number = 0, bad_lines = 0, first_bad_line = 0;
+    int rows = 0;
+    int carry = 0; // bytes of an incomplete line kept from the previous block
+    int status = 0;
+    fflush(stdout);
+    while (true) {
+        ssize_t r = read(fd, block + carry, CALC_BLOCK_SIZE - carry);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%scalc: %s%s\n", FG_RED, strerror(errno), RESET);
+            status = 1;
+            break;
+        }
+        const char *end = block + carry + r;
+        const char *line = block;
+        while (line < end) {
+            const char *newline = memchr(line, '\n', end - line);
+            if (newline == NULL) {
+                if (r > 0)
+                    break; // wait for the rest of the line
+                newline = end; // last line without '\n'
+            }
+            line_number++;
+            const char *p = line;
+            while (p < newline && calc_is_separator(*p))
+                p++;
+            if (p < newline) {
+                if (calc_parse_row(line, newline, &columns, batch, rows)) {
+                    if (++rows == CALC_BATCH) {
+                        calc_run(program, batch, rows);
+                        calc_output(batch->stack[0], rows, aggregates, &agg, out, &out_size);
+                        rows = 0;
+                    }
+                } else if (bad_lines++ == 0)
+                    first_bad_line = line_number;
+            }
+            line = newline + 1;
+        }
+        if (r == 0)
+            break;
+        carry = end > line ? end - line : 0;
+        if (carry == CALC_BLOCK_SIZE) {
+            fprintf(stderr, "%scalc: line %lld is too long%s\n", FG_RED, line_number + 1, RESET);
+            status = 1;
+            break;
+        }
+        memmove(block, line, carry);
+    }
+    if (rows > 0) {
+        calc_run(program, batch, rows);
+        calc_output(batch->stack[0], rows, aggregates, &agg, out, &out_size);
+    }
+    fwrite(out, 1, out_size, stdout);
+    if (aggregates & CALC_AGG_COUNT)
+        print_aggregate("count", agg.count);
+    if (agg.count > 0) {
+        if (aggregates & CALC_AGG_SUM)
+            print_aggregate("sum", agg.sum);
+        if (aggregates & CALC_AGG_MIN)
+            print_aggregate("min", agg.min);
+        if (aggregates & CALC_AGG_MAX)
+            print_aggregate("max", agg.max);
+        if (aggregates & CALC_AGG_MEAN)
+            print_aggregate("mean", agg.sum / agg.count);
+    }
+    fflush(stdout);
+    if (bad_lines > 0) {
+        fprintf(stderr, "%scalc: skipped %lld malformed line(s), first at line %lld%s\n",
+                FG_RED, bad_lines, first_bad_line, RESET);
+        status = 1;
+    }
+    if (fd != STDIN_FILENO)
+        close(fd);
+    free(out);
+    free(block);
+    free(batch);
+    free(program);
+    return status;
+}
+
+// In-process versions of small utilities, so that scripts calling them in a
+// loop don't pay for fork and exec. Each returns the exit status or
+// RUN_EXTERNAL when given something it doesn't support, then the real binary runs.
+#define RUN_EXTERNAL -1
+
+// errors after which copying is retried with a simpler method
+bool copy_unsupported(int error) {
+    return error == EINVAL || error == ENOSYS || error == EXDEV || error == EOPNOTSUPP
+        || error == EBADF || error == ETXTBSY;
+}
+
+// copies in to out, without going through userspace when the kernel can,
+// returns false on an error
+bool copy_fd(int in, int out) {
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1)
+        return false;
+    const size_t chunk = 1 << 30;
+    ssize_t n;
+    // each method continues from the offset the previous one stopped at
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        while ((n = copy_file_range(in, NULL, out, NULL, chunk, 0)) > 0 || (n == -1 && errno == EINTR))
+            ;
+        if (n == 0)
+            return true;
+        if (!copy_unsupported(errno))
+            return false;
+    }
+    if (S_ISREG(in_st.st_mode)) {
+        while ((n = sendfile(out, in, NULL, chunk)) > 0 || (n == -1 && errno == EINTR))
+            ;
+        if (n == 0)
+            return true;
+        if (!copy_unsupported(errno))
+            return false;
+    }
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        while ((n = splice(in, NULL, out, NULL, chunk, SPLICE_F_MOVE)) > 0 || (n == -1 && errno == EINTR))
+            ;
+        if (n == 0)
+            return true;
+        if (!copy_unsupported(errno))
+            return false;
+    }
+    static char buff[1 << 17];
+    while ((n = read(in, buff, sizeof(buff))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = write(out, buff + done, n - done);
+            if (w == -1 && errno != EINTR)
+                return false;
+            done += max(w, 0);
+        }
+    }
+    return true;
+}
+
+int cmd_cat(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0')
+            return RUN_EXTERNAL;
+    }
+    fflush(stdout);
+    // a file which is also stdout would be copied onto its own end forever
+    struct stat output;
+    int output_fd = stdout == record_stdout ? STDOUT_FILENO : fileno(stdout);
+    bool output_is_file = output_fd != -1 && fstat(output_fd, &output) == 0 && S_ISREG(output.st_mode);
+    int status = 0;
+    for (int i = 1; i < argc || i == 1; i++) {
+        bool from_stdin = i >= argc || strcmp(argv[i], "-") == 0;
+        const char *name = from_stdin ? "-" : argv[i];
+        int fd = from_stdin ? STDIN_FILENO : open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "%scat: %s: %s%s\n", FG_RED, argv[i], strerror(errno), RESET);
+            status = 1;
+            continue;
+        }
+        struct stat input;
+        if (output_is_file && fstat(fd, &input) == 0 && input.st_dev == output.st_dev && input.st_ino == output.st_ino) {
+            fprintf(stderr, "%scat: %s: input file is output file%s\n", FG_RED, name, RESET);
+            status = 1;
+            if (!from_stdin)
+                close(fd);
+            continue;
+        }
+        // stdout has no fd while captured by a command substitution
+        int out = fileno(stdout);
+        if (!(out == -1 ? copy_fd_to_stream(fd, stdout) : copy_fd(fd, out))) {
+            fprintf(stderr, "%scat: %s: %s%s\n", FG_RED, name, strerror(errno), RESET);
+            status = 1;
+        }
+        if (!from_stdin)
+            close(fd);
+    }
+    return status;
+}
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct LsEntry {
+    char *name;
+    int length;
+    bool directory;
+};
+
+int compare_ls_entries(const void *a, const void *b) {
+    return strcoll(((struct LsEntry *)a)->name, ((struct LsEntry *)b)->name);
+}
+
+// prints entries in columns filled top to bottom, like ls on a terminal
+void print_ls_columns(struct LsEntry *entries, int count, bool color) {
+    int width = get_terminal_width();
+    if (width <= 0)
+        width = 80;
+    int columns = 1, *widths = malloc(max(count, 1) * sizeof(int));
+    for (int c = count; c > 1; c--) {
+        int rows = (count + c - 1) / c;
+        if ((count + rows - 1) / rows != c)
+            continue; // same rows as a smaller number of columns
+        int total = 0;
+        for (int col = 0; col < c && total <= width; col++) {
+            widths[col] = 0;
+            for (int i = col * rows; i < min(count, (col + 1) * rows); i++)
+                widths[col] = max(widths[col], entries[i].length);
+            total += widths[col] + (col + 1 < c ? 2 : 0);
+        }
+        if (total <= width) {
+            columns = c;
+            break;
+        }
+    }
+    int rows = (count + columns - 1) / columns;
+    for (int col = 0; col < columns; col++) {
+        widths[col] = 0;
+        for (int i = col * rows; i < min(count, (col + 1) * rows); i++)
+            widths[col] = max(widths[col], entries[i].length);
+    }
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < columns; col++) {
+            int i = col * rows + row;
+            if (i >= count)
+                break;
+            bool last = col + 1 == columns || i + rows >= count;
+            if (color && entries[i].directory)
+                printf("%s%s%s%s", BOLD, C_PATH, entries[i].name, RESET);
+            else
+                printf("%s", entries[i].name);
+            if (!last)
+                printf("%*s", widths[col] - entries[i].length + 2, "");
+        }
+        printf("\n");
+    }
+    free(widths);
+}
+
+int cmd_ls(int argc, char **argv) {
+    bool all = false, almost_all = false, one_per_line = !stdout_is_terminal();
+    const char *path = ".";
+    int paths = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            for (const char *c = argv[i] + 1; *c != '\0'; c++) {
+                if (*c == 'a')
+                    all = true;
+                else if (*c == 'A')
+                    almost_all = true;
+                else if (*c == '1')
+                    one_per_line = true;
+                else
+                    return RUN_EXTERNAL;
+            }
+        } else {
+            path = argv[i];
+            paths++;
+        }
+    }
+    if (paths > 1)
+        return RUN_EXTERNAL;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOTDIR)
+        return RUN_EXTERNAL; // a single file
+    if (fd == -1) {
+        fprintf(stderr, "%sls: cannot access '%s': %s%s\n", FG_RED, path, strerror(errno), RESET);
+        return 2;
+    }
+
+    // names are read in batches straight from the kernel, d_type tells
+    // directories apart without a stat per entry
+    static char batch[1 << 16];
+    int count = 0, capacity = 256;
+    struct LsEntry *entries = malloc(capacity * sizeof(struct LsEntry));
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, batch, sizeof(batch))) > 0) {
+        for (long offset = 0; offset < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(batch + offset);
+            offset += d->d_reclen;
+            bool hidden = d->d_name[0] == '.';
+            bool dots = hidden && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'));
+            if (hidden && !all && !(almost_all && !dots))
+                continue;
+            if (count == capacity) {
+                capacity *= 2;
+                entries = realloc(entries, capacity * sizeof(struct LsEntry));
+            }
+            bool directory = d->d_type == DT_DIR;
+            if (d->d_type == DT_UNKNOWN) {
+                struct stat st;
+                directory = fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            entries[count].name = strdup(d->d_name);
+            entries[count].length = strlen(d->d_name);
+            entries[count].directory = directory;
+            count++;
+        }
+    }
+    int status = 0;
+    if (n == -1) {
+        fprintf(stderr, "%sls: reading directory '%s': %s%s\n", FG_RED, path, strerror(errno), RESET);
+        status = 2;
+    }
+    close(fd);
+    qsort(entries, count, sizeof(struct LsEntry), compare_ls_entries);
+    if (one_per_line) {
+        for (int i = 0; i < count; i++)
+            printf("%s\n", entries[i].name);
+    } else
+        print_ls_columns(entries, count, true);
+    for (int i = 0; i < count; i++)
+        free(entries[i].name);
+    free(entries);
+    return status;
+}
+
+struct WcCounts {
+    long long lines;
+    long long words;
+    long long bytes;
+};
+
+typedef unsigned char wc_vector __attribute__((vector_size(16)));
+
+// counts lines and word starts in data, data[-1] has to be the byte before it
+void wc_count(const unsigned char *data, size_t length, struct WcCounts *counts) {
+    size_t i = 0;
+    while (i + 16 <= length) {
+        // per lane counters, can't overflow in 255 steps
+        wc_vector lines = {0}, words = {0};
+        size_t end = i + 16 * 255 < length ? i + 16 * 255 : length;
+        for (; i + 16 <= end; i += 16) {
+            wc_vector current, previous;
+            memcpy(&current, data + i, 16);
+            memcpy(&previous, data + i - 1, 16);
+            // whitespace: space and \t \n \v \f \r (9 to 13)
+            wc_vector space = (wc_vector)(current == ' ') | (wc_vector)((wc_vector)(current - 9) < 5);
+            wc_vector previous_space = (wc_vector)(previous == ' ') | (wc_vector)((wc_vector)(previous - 9) < 5);
+            lines -= (wc_vector)(current == '\n');
+            words -= ~space & previous_space;
+        }
+        for (int lane = 0; lane < 16; lane++) {
+            counts->lines += lines[lane];
+            counts->words += words[lane];
+        }
+    }
+    for (; i < length; i++) {
+        bool space = data[i] == ' ' || (unsigned char)(data[i] - 9) < 5;
+        bool previous_space = data[i - 1] == ' ' || (unsigned char)(data[i - 1] - 9) < 5;
+        counts->lines += data[i] == '\n';
+        counts->words += !space && previous_space;
+    }
+}
+
+// returns false on a read error
+bool wc_fd(int fd, bool only_bytes, struct WcCounts *counts) {
+    struct stat st;
+    if (only_bytes && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        counts->bytes = st.st_size - max(0, lseek(fd, 0, SEEK_CUR));
+        return true;
+    }
+    static unsigned char block[1 + (1 << 20)];
+    block[0] = ' '; // the byte before the first one
+    ssize_t n;
+    while ((n = read(fd, block + 1, sizeof(block) - 1)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        wc_count(block + 1, n, counts);
+        counts->bytes += n;
+        block[0] = block[n];
+    }
+    return true;
+}
+
+void print_wc_counts(const struct WcCounts *counts, bool lines, bool words, bool bytes, int width, const char *name) {
+    const char *separator = "";
+    if (lines) {
+        printf("%*lld", width, counts->lines);
+        separator = " ";
+    }
+    if (words) {
+        printf("%s%*lld", separator, width, counts->words);
+        separator = " ";
+    }
+    if (bytes)
+        printf("%s%*lld", separator, width, counts->bytes);
+    if (name != NULL)
+        printf(" %s", name);
+    printf("\n");
+}
+
+int cmd_wc(int argc, char **argv) {
+    bool lines = false, words = false, bytes = false;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0')
+            continue;
+        for (const char *c = argv[i] + 1; *c != '\0'; c++) {
+            if (*c == 'l')
+                lines = true;
+            else if (*c == 'w')
+                words = true;
+            else if (*c == 'c')
+                bytes = true;
+            else
+                return RUN_EXTERNAL;
+        }
+    }
+    if (!lines && !words && !bytes)
+        lines = words = bytes = true;
+
+    // everything is opened first, like in GNU wc the column width
+    // depends on the total size of the files
+    int files = 0;
+    char **names = malloc(argc * sizeof(char *));
+    int *fds = malloc(argc * sizeof(int));
+    int *errors = malloc(argc * sizeof(int));
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0')
+            names[files++] = argv[i];
+    }
+    int inputs = max(files, 1);
+    int width = 1, min_width = 1;
+    long long total_size = 0;
+    for (int i = 0; i < inputs; i++) {
+        bool from_stdin = files == 0 || strcmp(names[i], "-") == 0;
+        fds[i] = from_stdin ? STDIN_FILENO : open(names[i], O_RDONLY | O_CLOEXEC);
+        errors[i] = fds[i] == -1 ? errno : 0;
+        struct stat st;
+        if (fds[i] == -1)
+            continue;
+        if (fstat(fds[i], &st) == 0 && S_ISREG(st.st_mode))
+            total_size += st.st_size;
+        else
+            min_width = 7;
+    }
+    for (; total_size >= 10; total_size /= 10)
+        width++;
+    width = max(width, min_width);
+    if (lines + words + bytes == 1 && inputs == 1)
+        width = 1;
+
+    int status = 0;
+    struct WcCounts total = {0};
+    for (int i = 0; i < inputs; i++) {
+        const char *name = files == 0 ? NULL : names[i];
+        struct WcCounts counts = {0};
+        if (fds[i] != -1 && !wc_fd(fds[i], bytes && !lines && !words, &counts))
+            errors[i] = errno;
+        if (fds[i] == -1 || errors[i] != 0) {
+            fflush(stdout);
+            fprintf(stderr, "%swc: %s: %s%s\n", FG_RED, name != NULL ? name : "-", strerror(errors[i]), RESET);
+            status = 1;
+        } else
+            print_wc_counts(&counts, lines, words, bytes, width, name);
+        if (fds[i] > STDIN_FILENO)
+            close(fds[i]);
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    }
+    if (files > 1)
+        print_wc_counts(&total, lines, words, bytes, width, "total");
+    free(names);
+    free(fds);
+    free(errors);
+    return status;
+}
+
+// bash's echo: -n no newline, -e interpret escapes, -E don't
+int cmd_echo(int argc, char **argv) {
+    bool newline = true, escapes = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1))
+            break; // not an option, printed
+        for (const char *c = argv[i] + 1; *c != '\0'; c++) {
+            if (*c == 'n')
+                newline = false;
+            else
+                escapes = *c == 'e';
+        }
+    }
+    for (int first = i; i < argc; i++) {
+        if (i > first)
+            putchar(' ');
+        if (!escapes) {
+            fputs(argv[i], stdout);
+            continue;
+        }
+        for (const char *c = argv[i]; *c != '\0'; c++) {
+            if (*c != '\\' || c[1] == '\0') {
+                putchar(*c);
+                continue;
+            }
+            c++;
+            const char *simple = strchr("abefnrtv\\", *c);
+            if (simple != NULL)
+                putchar("\a\b\e\f\n\r\t\v\\"[simple - "abefnrtv\\"]);
+            else if (*c == 'c')
+                return 0; // no further output
+            else if (*c == '0' || *c == 'x') {
+                // \0nnn octal, \xHH hex
+                bool hex = *c == 'x';
+                int value = 0, digits = 0;
+                while (digits < (hex ? 2 : 3) && (hex ? isxdigit(c[1]) : c[1] >= '0' && c[1] <= '7')) {
+                    c++;
+                    value = value * (hex ? 16 : 8) + (isdigit(*c) ? *c - '0' : tolower(*c) - 'a' + 10);
+                    digits++;
+                }
+                if (hex && digits == 0)
+                    printf("\\x");
+                else
+                    putchar(value);
+            } else {
+                putchar('\\');
+                putchar(*c);
+            }
+        }
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+int cmd_pwd(int argc, char **argv) {
+    if (argc > 1)
+        return RUN_EXTERNAL;
+    char path[4096];
+    if (getcwd(path, sizeof(path)) == NULL) {
+        fprintf(stderr, "%spwd: %s%s\n", FG_RED, strerror(errno), RESET);
+        return 1;
+    }
+    printf("%s\n", path);
+    return 0;
+}
+
+// shows resource usage after every command when on
+bool show_stats = false;
+
+// kilobytes as a short human readable size
+void format_size(long kilobytes, char *out) {
+    if (kilobytes <= 0)
+        strcpy(out, "-");
+    else if (kilobytes < 1024)
+        sprintf(out, "%ldK", kilobytes);
+    else if (kilobytes < 1024 * 1024)
+        sprintf(out, "%.1fM", kilobytes / 1024.0);
+    else
+        sprintf(out, "%.1fG", kilobytes / (1024.0 * 1024.0));
+}
+
+// names of LIMIT_ flags, empty if there are none
+void format_limits_hit(int limits_hit, char *out) {
+    sprintf(out, "%s%s%s", limits_hit & LIMIT_MEM ? "mem" : "",
+            limits_hit == (LIMIT_MEM | LIMIT_CPU_TIME) ? ", " : "",
+            limits_hit & LIMIT_CPU_TIME ? "cpu time" : "");
+}
+
+void print_command_stats(const struct CommandStats *stats) {
+    char rss[32], limits[32];
+    format_size(stats->max_rss, rss);
+    format_limits_hit(stats->limits_hit, limits);
+    fflush(stdout);
+    fprintf(stderr, "%s[status %d | real %.3fs user %.3fs sys %.3fs | max rss %s | "
+            "faults %ld minor %ld major | switches %ld voluntary %ld involuntary%s%s]%s\n",
+            C_PATH, stats->status, stats->real, stats->user, stats->sys, rss,
+            stats->minor_faults, stats->major_faults,
+            stats->voluntary_switches, stats->involuntary_switches,
+            limits[0] != '\0' ? " | limit hit: " : "", limits, RESET);
+}
+
+// writes recorded spans in Chrome's trace event format (loads in Perfetto)
+bool dump_trace(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+    uint64_t first = head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0;
+    int pid = getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (uint64_t i = first; i < head; i++) {
+        const struct TraceSpan *span = &trace_ring[i & (TRACE_CAPACITY - 1)];
+        // timestamps are in microseconds
+        fprintf(file, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,", span->name, span->phase, span->start / 1e3);
+        if (span->phase == 'X')
+            fprintf(file, "\"dur\":%.3f,", span->duration / 1e3);
+        else
+            fprintf(file, "\"s\":\"t\",\"args\":{\"key\":%d},", span->arg);
+        fprintf(file, "\"pid\":%d,\"tid\":%d}%s\n", pid, pid, i + 1 < head ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    return fclose(file) == 0;
+}
+
+int cmd_trace(int argc, char **argv) {
+    if (argc == 1) {
+        uint64_t dropped = trace_head > TRACE_CAPACITY ? trace_head - TRACE_CAPACITY : 0;
+        printf("tracing is %s, %llu spans recorded, %llu overwritten\n", tracing ? "on" : "off",
+                (unsigned long long)(trace_head - dropped), (unsigned long long)dropped);
+    } else if (argc == 2 && strcmp(argv[1], "on") == 0) {
+        trace_head = 0;
+        tracing = true;
+    } else if (argc == 2 && strcmp(argv[1], "off") == 0) {
+        tracing = false;
+    } else if (argc == 3 && strcmp(argv[1], "dump") == 0) {
+        if (!dump_trace(argv[2])) {
+            fprintf(stderr, "%strace: can't write %s: %s%s\n", FG_RED, argv[2], strerror(errno), RESET);
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "%susage: trace [on|off|dump <file>]%s\n", FG_RED, RESET);
+        return 2;
+    }
+    return 0;
+}
+
+int cmd_stats(int argc, char **argv) {
+    if (argc == 1) {
+        printf("stats are %s\n", show_stats ? "on" : "off");
+        return 0;
+    }
+    if (argc > 2) {
+        fprintf(stderr, "%stoo many arguments!%s\n", FG_RED, RESET);
+        return 1;
+    }
+    if (strcmp(argv[1], "on") == 0)
+        show_stats = true;
+    else if (strcmp(argv[1], "off") == 0)
+        show_stats = false;
+    else {
+        fprintf(stderr, "%susage: stats [on|off]%s\n", FG_RED, RESET);
+        return 2;
+    }
+    return 0;
+}
+
+// history --stats --sort orders entries by this, largest first
+enum HistorySort {
+    HISTORY_SORT_NONE,
+    HISTORY_SORT_REAL,
+    HISTORY_SORT_RSS
+};
+
+enum HistorySort history_sort = HISTORY_SORT_NONE;
+
+int compare_history_entries(const void *a, const void *b) {
+    const struct CommandStats *x = &history_stats[*(const int *)a];
+    const struct CommandStats *y = &history_stats[*(const int *)b];
+    double diff = history_sort == HISTORY_SORT_REAL ? y->real - x->real : (double)y->max_rss - x->max_rss;
+    return diff < 0 ? -1 : diff > 0;
+}
+
+// `history [--stats [--sort real|rss]] [N]`, the last N entries or with
+// --sort the N slowest or most memory hungry ones
+int cmd_history(int argc, char **argv) {
+    bool with_stats = false;
+    int limit = HISTORY_SIZE;
+    history_sort = HISTORY_SORT_NONE;
+    bool valid = true;
+    for (int i = 1; i < argc && valid; i++) {
+        char *end;
+        if (strcmp(argv[i], "--stats") == 0)
+            with_stats = true;
+        else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "real") == 0)
+                history_sort = HISTORY_SORT_REAL;
+            else if (strcmp(argv[i], "rss") == 0)
+                history_sort = HISTORY_SORT_RSS;
+            else
+                valid = false;
+        } else if ((limit = strtol(argv[i], &end, 10)) <= 0 || *end != '\0')
+            valid = false;
+    }
+    if (!valid || (history_sort != HISTORY_SORT_NONE && !with_stats)) {
+        fprintf(stderr, "%susage: history [--stats [--sort real|rss]] [N]%s\n", FG_RED, RESET);
+        return 2;
+    }
+    // indices of the entries to show, sorting skips ones without stats
+    int order[HISTORY_SIZE];
+    int count = 0;
+    for (int i = 0; i < his_top; i++) {
+        if (history_sort == HISTORY_SORT_NONE || history_has_stats[i])
+            order[count++] = i;
+    }
+    int first = 0;
+    if (history_sort != HISTORY_SORT_NONE) {
+        qsort(order, count, sizeof(int), compare_history_entries);
+        count = min(count, limit);
+    } else
+        first = max(0, count - limit);
+
+    if (with_stats)
+        printf("%s%5s %6s %9s %9s %9s %8s %9s  %s%s\n", BOLD,
+                "n", "status", "real", "user", "sys", "max rss", "faults", "command", RESET);
+    for (int k = first; k < count; k++) {
+        int i = order[k];
+        if (!with_stats) {
+            printf("%5d  %s\n", i + 1, history[i]);
+            continue;
+        }
+        if (!history_has_stats[i]) {
+            printf("%5d %6s %9s %9s %9s %8s %9s  %s\n", i + 1, "-", "-", "-", "-", "-", "-", history[i]);
+            continue;
+        }
+        const struct CommandStats *stats = &history_stats[i];
+        char rss[32], limits[32];
+        format_size(stats->max_rss, rss);
+        format_limits_hit(stats->limits_hit, limits);
+        printf("%5d %s%6d%s %8.3fs %8.3fs %8.3fs %8s %9ld  %s%s%s%s%s\n", i + 1,
+                stats->status != 0 ? FG_RED : "", stats->status, RESET,
+                stats->real, stats->user, stats->sys, rss,
+                stats->minor_faults + stats->major_faults, history[i],
+                limits[0] != '\0' ? FG_RED " [limit hit: " : "", limits, limits[0] != '\0' ? "]" : "", RESET);
+    }
+    return 0;
+}
+
+int cmd_time(int argc, char **argv, struct CommandStats *stats);
+int cmd_limit(int argc, char **argv, struct CommandStats *stats);
+int cmd_record(int argc, char **argv);
+int cmd_watch(int argc, char **argv);
+bool changes_shell_state(const char *name);
+
+// index of the command a line runs, past any leading `time`
+int command_start(int argc, char **argv) {
+    int first = 0;
+    while (first < argc - 1 && strcmp(argv[first], "time") == 0)
+        first++;
+    return first;
+}
+
+// runs a builtin or an external command, returns its exit status
+int run_command(int argc, char **argv, struct CommandStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    // builtins run inside the shell, so their usage is the difference of ours
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    double start = monotonic_seconds();
+    TRACE_BEGIN(span);
+
+    int status = 0;
+    if (strcmp(argv[0], "exit") == 0)
+        cmd_exit();
+    else if (strcmp(argv[0], "time") == 0)
+        return cmd_time(argc, argv, stats);
+    else if (strcmp(argv[0], "limit") == 0)
+        return cmd_limit(argc, argv, stats);
+    else if (strcmp(argv[0], "cd") == 0)
+        status = cmd_cd(argc, argv);
+    else if (strcmp(argv[0], "pushd") == 0)
+        status = cmd_pushd(argc, argv);
+    else if (strcmp(argv[0], "popd") == 0)
+        status = cmd_popd();
+    else if (strcmp(argv[0], "dirs") == 0)
+        status = cmd_dirs(argc, argv);
+    else if (strcmp(argv[0], "z") == 0)
+        status = cmd_z(argc, argv);
+    else if (strcmp(argv[0], "type") == 0)
+        status = cmd_type(argc, argv);
+    else if (strcmp(argv[0], "args") == 0)
+        status = cmd_args(argc, argv);
+    else if (strcmp(argv[0], "help") == 0)
+        status = cmd_help();
+    else if (strcmp(argv[0], "ps") == 0)
+        status = cmd_ps();
+    else if (strcmp(argv[0], "calc") == 0)
+        status = cmd_calc(argc, argv);
+    else if (strcmp(argv[0], "history") == 0)
+        status = cmd_history(argc, argv);
+    else if (strcmp(argv[0], "stats") == 0)
+        status = cmd_stats(argc, argv);
+    else if (strcmp(argv[0], "trace") == 0)
+        status = cmd_trace(argc, argv);
+    else if (strcmp(argv[0], "watch") == 0)
+        status = cmd_watch(argc, argv);
+    else if (strcmp(argv[0], "record") == 0)
+        status = cmd_record(argc, argv);
+    else if (strcmp(argv[0], "cat") == 0)
+        status = cmd_cat(argc, argv);
+    else if (strcmp(argv[0], "ls") == 0)
+        status = cmd_ls(argc, argv);
+    else if (strcmp(argv[0], "wc") == 0)
+        status = cmd_wc(argc, argv);
+    else if (strcmp(argv[0], "echo") == 0)
+        status = cmd_echo(argc, argv);
+    else if (strcmp(argv[0], "pwd") == 0)
+        status = cmd_pwd(argc, argv);
+    else if (strcmp(argv[0], "true") == 0)
+        status = 0;
+    else if (strcmp(argv[0], "false") == 0)
+        status = 1;
+    else
+        status = RUN_EXTERNAL;
+    if (status == RUN_EXTERNAL) {
+        execute_command(argv[0], argv, argc, stats);
+        TRACE_END(span, "execute_command");
+        return stats->status;
+    }
+    TRACE_END(span, find_builtin(argv[0]));
+    stats->status = status;
+
+    getrusage(RUSAGE_SELF, &after);
+    stats->real = monotonic_seconds() - start;
+    stats->user = timeval_seconds(after.ru_utime) - timeval_seconds(before.ru_utime);
+    stats->sys = timeval_seconds(after.ru_stime) - timeval_seconds(before.ru_stime);
+    stats->minor_faults = after.ru_minflt - before.ru_minflt;
+    stats->major_faults = after.ru_majflt - before.ru_majflt;
+    stats->voluntary_switches = after.ru_nvcsw - before.ru_nvcsw;
+    stats->involuntary_switches = after.ru_nivcsw - before.ru_nivcsw;
+    return stats->status;
+}
+
+// seconds in the format of bash's time: 0m0.000s
+void print_time_line(const char *name, double seconds) {
+    int minutes = seconds / 60;
+    fprintf(stderr, "%s\t%dm%.3fs\n", name, minutes, seconds - minutes * 60);
+}
+
+int cmd_time(int argc, char **argv, struct CommandStats *stats) {
+    if (argc == 1) {
+        fprintf(stderr, "%sname a command!%s\n", FG_RED, RESET);
+        stats->status = 1;
+        return 1;
+    }
+    int status = run_command(argc - 1, argv + 1, stats);
+    fflush(stdout);
+    fprintf(stderr, "\n");
+    print_time_line("real", stats->real);
+    print_time_line("user", stats->user);
+    print_time_line("sys", stats->sys);
+    return status;
+}
+
+// sizes like 512K, 2G or 1.5GiB, multiples of 1024
+bool parse_size(const char *text, rlim_t *bytes) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || !(value > 0))
+        return false;
+    const char *units = "KMGT";
+    const char *unit = *end == '\0' ? NULL : strchr(units, toupper(*end));
+    if (unit != NULL) {
+        value *= pow(1024, unit - units + 1);
+        end++;
+        if (*end == 'i')
+            end++;
+    }
+    if (toupper(*end) == 'B')
+        end++;
+    *bytes = value;
+    return *end == '\0' && *bytes > 0;
+}
+
+// lists of cores like 0-3,6
+bool parse_cpu_list(const char *text, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    const char *p = text;
+    while (true) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+            return false;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return false;
+        }
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+        if (*end == '\0')
+            return true;
+        if (*end != ',')
+            return false;
+        p = end + 1;
+    }
+}
+
+// `limit [--mem SIZE] [--time SECONDS] [--nofile N] [--cpu LIST] [--nice N] [--] command`
+// runs a program with the limits applied in its child, the ones it ran into
+// are reported: CPU time by the signal, address space by an allocation past it
+int cmd_limit(int argc, char **argv, struct CommandStats *stats) {
+    struct SpawnLimits limits = {0};
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        const char *value = i + 1 < argc ? argv[i + 1] : "";
+        char *end;
+        long number = strtol(value, &end, 10);
+        bool valid = end != value && *end == '\0';
+        if (strcmp(argv[i], "--mem") == 0)
+            valid = parse_size(value, &limits.mem);
+        else if (strcmp(argv[i], "--time") == 0) {
+            valid = valid && number > 0;
+            limits.cpu_time = number;
+        } else if (strcmp(argv[i], "--nofile") == 0) {
+            valid = valid && number > 0;
+            limits.nofile = number;
+        } else if (strcmp(argv[i], "--cpu") == 0) {
+            valid = parse_cpu_list(value, &limits.cpus);
+            limits.has_cpus = true;
+        } else if (strcmp(argv[i], "--nice") == 0) {
+            valid = valid && number >= -20 && number <= 19;
+            limits.has_nice = true;
+            limits.nice = number;
+        } else {
+            fprintf(stderr, "%slimit: unknown option %s%s\n", FG_RED, argv[i], RESET);
+            return stats->status = 2;
+        }
+        if (!valid) {
+            fprintf(stderr, "%slimit: bad value '%s' for %s%s\n", FG_RED, value, argv[i], RESET);
+            return stats->status = 2;
+        }
+    }
+    if (i >= argc) {
+        fprintf(stderr, "%susage: limit [--mem SIZE] [--time SECONDS] [--nofile N] [--cpu LIST] [--nice N] [--] command%s\n", FG_RED, RESET);
+        return stats->status = 2;
+    }
+    if (is_builtin(argv[i]) && !command_exists(argv[i])) {
+        fprintf(stderr, "%slimit: %s runs inside the shell, limits apply to programs%s\n", FG_RED, argv[i], RESET);
+        return stats->status = 2;
+    }
+
+    struct AllocationObserver *observer = &limits.observer;
+    observer->listener = -1;
+    observer->cap = limits.mem;
+    if (limits.mem > 0 && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, observer->socket) == -1) {
+        fprintf(stderr, "%slimit: %s%s\n", FG_RED, strerror(errno), RESET);
+        return stats->status = 1;
+    }
+    spawn_limits = &limits;
+    execute_command(argv[i], argv + i, argc - i, stats);
+    spawn_limits = NULL;
+
+    int signal = stats->status > 128 ? stats->status - 128 : 0;
+    if (limits.cpu_time > 0 && (signal == SIGXCPU || (signal == SIGKILL && stats->user + stats->sys >= limits.cpu_time)))
+        stats->limits_hit |= LIMIT_CPU_TIME;
+    if (observer->refused > 0)
+        stats->limits_hit |= LIMIT_MEM;
+    fflush(stdout);
+    if (stats->limits_hit != 0) {
+        char names[32], largest[32] = "";
+        format_limits_hit(stats->limits_hit, names);
+        if (observer->refused > 0)
+            format_size(observer->largest / 1024, largest);
+        fprintf(stderr, "%slimit: %s limit hit%s%s%s%s\n", FG_RED, names,
+                observer->refused > 0 ? ", refused allocations up to " : "", largest,
+                observer->refused > 0 ? " past the cap" : "", RESET);
+    } else if (limits.mem > 0 && observer->listener == -1 && stats->status != 0 && stats->status != 126) {
+        // without seccomp the refusals aren't seen
+        char peak[32];
+        format_size(stats->max_rss, peak);
+        fprintf(stderr, "%slimit: failed with --mem set, an allocation may have failed (max rss %s)%s\n",
+                FG_RED, peak, RESET);
+    }
+    return stats->status;
+}
+
+// opens a log written by `record on`, -1 with an error printed on failure
+int record_open(const char *path, struct RecordHeader *header) {
+    if (record_fd != -1 && strcmp(path, record_path) == 0) {
+        fflush(stdout);
+        record_flush(); // the pending chunk is part of what's asked for
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "%srecord: %s: %s%s\n", FG_RED, path, strerror(errno), RESET);
+        return -1;
+    }
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+            memcmp(header->magic, RECORD_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "%srecord: %s isn't a session log%s\n", FG_RED, path, RESET);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// payload of the record at offset, decompressed into out of RECORD_CHUNK bytes
+bool record_payload(int fd, uint64_t offset, const struct RecordChunk *chunk, char *out) {
+    static uint8_t stored[RECORD_COMPRESSED_MAX];
+    if (chunk->stored > sizeof(stored) || chunk->length > RECORD_CHUNK ||
+            pread(fd, stored, chunk->stored, RECORD_RING_START + offset + sizeof(*chunk)) != chunk->stored)
+        return false;
+    if (chunk->stored == chunk->length) {
+        memcpy(out, stored, chunk->length);
+        return true;
+    }
+    return lz4_decompress(stored, chunk->stored, (uint8_t *)out, RECORD_CHUNK) == (int)chunk->length;
+}
+
+// marker of command number (counted from 1), false if it was overwritten
+bool record_find_marker(int fd, const struct RecordHeader *header, uint64_t number, struct RecordMarker *marker) {
+    if (number == 0 || number > header->marker_count || number + RECORD_INDEX_SLOTS <= header->marker_count)
+        return false;
+    uint64_t slot = (number - 1) % RECORD_INDEX_SLOTS;
+    return pread(fd, marker, sizeof(*marker), RECORD_HEADER_SIZE + slot * sizeof(*marker)) == sizeof(*marker) &&
+            marker->sequence >= header->tail_sequence && marker->sequence < header->next_sequence;
+}
+
+bool record_list(const char *path) {
+    struct RecordHeader header;
+    int fd = record_open(path, &header);
+    if (fd == -1)
+        return false;
+    static char line[RECORD_CHUNK + 1];
+    uint64_t first = header.marker_count > RECORD_INDEX_SLOTS ? header.marker_count - RECORD_INDEX_SLOTS + 1 : 1;
+    for (uint64_t number = first; number <= header.marker_count; number++) {
+        struct RecordMarker marker;
+        struct RecordChunk chunk;
+        if (!record_find_marker(fd, &header, number, &marker) || !record_read_chunk(fd, marker.offset, &chunk) ||
+                chunk.sequence != marker.sequence || !record_payload(fd, marker.offset, &chunk, line))
+            continue; // the ring overwrote it
+        line[chunk.length] = '\0';
+        time_t seconds = marker.time / 1000000000;
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+        printf("%5llu  %s  %s\n", (unsigned long long)number, when, line);
+    }
+    close(fd);
+    return true;
+}
+
+// writes the recorded output, of command number only if it isn't 0
+bool record_play(const char *path, uint64_t number) {
+    struct RecordHeader header;
+    int fd = record_open(path, &header);
+    if (fd == -1)
+        return false;
+    uint64_t offset = header.tail, sequence = header.tail_sequence;
+    if (number != 0) {
+        struct RecordMarker marker;
+        if (!record_find_marker(fd, &header, number, &marker)) {
+            fprintf(stderr, "%srecord: command %llu isn't in the log%s\n", FG_RED, (unsigned long long)number, RESET);
+            close(fd);
+            return false;
+        }
+        offset = marker.offset;
+        sequence = marker.sequence;
+    }
+    uint64_t first = sequence;
+    bool damaged = false;
+    static char data[RECORD_CHUNK];
+    for (; sequence < header.next_sequence; sequence++) {
+        struct RecordChunk chunk;
+        if (!record_read_chunk(fd, offset, &chunk) || chunk.sequence != sequence || !record_payload(fd, offset, &chunk, data)) {
+            fprintf(stderr, "%srecord: %s is damaged at record %llu%s\n", FG_RED, path, (unsigned long long)sequence, RESET);
+            damaged = true;
+            break;
+        }
+        // a command's output ends at the next command line
+        if (chunk.type == 'C' && number != 0 && sequence != first)
+            break;
+        // command lines are in the output already, echoed by the prompt
+        if (chunk.type == 'O')
+            fwrite(data, 1, chunk.length, stdout);
+        offset = record_next(&header, offset, &chunk);
+    }
+    fflush(stdout);
+    close(fd);
+    return !damaged;
+}
+
+// `record`, `record on file [size]`, `record off`, `record list file`, `record play file [n]`
+int cmd_record(int argc, char **argv) {
+    if (argc == 1) {
+        if (record_fd == -1) {
+            printf("recording is off\n");
+            return 0;
+        }
+        fflush(stdout);
+        char in[32], stored[32], ring[32];
+        format_size((record_bytes_in + record_chunk_length) / 1024, in);
+        format_size(record_bytes_stored / 1024, stored);
+        format_size(record_header.capacity / 1024, ring);
+        printf("recording to %s: %s recorded, %s written, ring of %s\n", record_path, in, stored, ring);
+        return 0;
+    }
+    if (strcmp(argv[1], "on") == 0 && (argc == 3 || argc == 4)) {
+        rlim_t size = RECORD_DEFAULT_SIZE;
+        if (argc == 4 && (!parse_size(argv[3], &size) || size < RECORD_MIN_SIZE)) {
+            fprintf(stderr, "%srecord: size must be at least 1M%s\n", FG_RED, RESET);
+            return 1;
+        }
+        record_stop();
+        if (!record_start(argv[2], size)) {
+            fprintf(stderr, "%srecord: %s: %s%s\n", FG_RED, argv[2], strerror(errno), RESET);
+            return 1;
+        }
+    } else if (strcmp(argv[1], "off") == 0 && argc == 2)
+        record_stop();
+    else if (strcmp(argv[1], "list") == 0 && argc == 3)
+        return record_list(argv[2]) ? 0 : 1;
+    else if (strcmp(argv[1], "play") == 0 && (argc == 3 || argc == 4)) {
+        char *end = "";
+        unsigned long long number = argc == 4 ? strtoull(argv[3], &end, 10) : 0;
+        if (*end != '\0' || (argc == 4 && number == 0)) {
+            fprintf(stderr, "%srecord: bad command number '%s'%s\n", FG_RED, argv[3], RESET);
+            return 2;
+        }
+        return record_play(argv[2], number) ? 0 : 1;
+    } else {
+        fprintf(stderr, "%susage: record [on file [size] | off | list file | play file [n]]%s\n", FG_RED, RESET);
+        return 2;
+    }
+    return 0;
+}
+
+// `watch` runs a command every interval and shows its output full screen.
+// Output is captured into a memfd which is reused between runs: builtins run
+// in-process with stdout redirected, external commands inherit it. Only the lines
+// that differ from the previous frame are redrawn, changed characters in reverse.
+
+#define WATCH_MAX_ROWS 500 // highlights on rows past it are not cleared
+
+struct WatchFrame {
+    char *text; // without escape codes, tabs expanded
+    int size;
+    int capacity;
+    int *lines; // line start offsets, lines[line_count] is the end
+    int line_count;
+    int line_capacity;
+};
+
+void watch_add_char(struct WatchFrame *frame, char c) {
+    if (frame->size == frame->capacity) {
+        frame->capacity = max(4096, frame->capacity * 2);
+        frame->text = realloc(frame->text, frame->capacity);
+    }
+    frame->text[frame->size++] = c;
+}
+
+void watch_add_line(struct WatchFrame *frame) {
+    if (frame->line_count + 1 >= frame->line_capacity) {
+        frame->line_capacity = max(64, frame->line_capacity * 2);
+        frame->lines = realloc(frame->lines, frame->line_capacity * sizeof(int));
+    }
+    frame->lines[++frame->line_count] = frame->size;
+}
+
+// fills frame from raw output, so that its columns are the screen's columns
+void watch_parse(const char *raw, int length, struct WatchFrame *frame) {
+    frame->size = 0;
+    frame->line_count = -1;
+    watch_add_line(frame); // lines[0] = 0
+    int column = 0;
+    for (int i = 0; i < length; i++) {
+        char c = raw[i];
+        if (c == '\e') {
+            // CSI sequences end with a byte from @ to ~, others are two bytes long
+            if (i + 1 < length && raw[i + 1] == '[') {
+                i += 2;
+                while (i < length && (raw[i] < '@' || raw[i] > '~'))
+                    i++;
+            } else
+                i++;
+        } else if (c == '\n') {
+            watch_add_line(frame);
+            column = 0;
+        } else if (c == '\t') {
+            do
+                watch_add_char(frame, ' ');
+            while (++column % 8 != 0);
+        } else if (!iscntrl((unsigned char)c)) {
+            watch_add_char(frame, c);
+            column++;
+        }
+    }
+    // unterminated last line
+    if (frame->size > frame->lines[frame->line_count])
+        watch_add_line(frame);
+}
+
+// redraws screen row (counted from 1) if the line changed since the previous
+// frame, old is NULL to force it, returns whether anything was highlighted
+bool watch_draw_line(int row, const char *line, int length, const char *old, int old_length, int width, bool highlight) {
+    length = min(length, width);
+    old_length = min(old_length, width);
+    if (old != NULL && length == old_length && memcmp(line, old, length) == 0)
+        return false;
+    printf("\e[%d;1H", row);
+    bool reversed = false, highlighted = false;
+    for (int i = 0; i < length; i++) {
+        bool changed = highlight && old != NULL && (i >= old_length || line[i] != old[i]);
+        if (changed != reversed) {
+            printf("%s", changed ? REVERSE : RESET);
+            reversed = changed;
+        }
+        highlighted |= changed;
+        putchar(line[i]);
+    }
+    printf("%s\e[K", RESET); // erase the rest of the old line
+    return highlighted;
+}
+
+// runs the command with its output going to capture, returns the exit status
+int watch_run(int argc, char **argv, int capture) {
+    fflush(stdout);
+    fflush(stderr);
+    ftruncate(capture, 0);
+    lseek(capture, 0, SEEK_SET);
+    int saved_out = dup(STDOUT_FILENO);
+    int saved_err = dup(STDERR_FILENO);
+    dup2(capture, STDOUT_FILENO);
+    dup2(capture, STDERR_FILENO);
+    // the frames drawn from it are recorded, not the capture
+    bool paused = record_paused;
+    record_paused = true;
+    struct CommandStats stats;
+    if (changes_shell_state(argv[command_start(argc, argv)])) {
+        // cd, pushd and the like would change the shell on every tick,
+        // they run in a child like in a command substitution
+        pid_t id = fork();
+        if (id == 0) {
+            sigprocmask(SIG_SETMASK, &original_signal_mask, NULL);
+            run_command(argc, argv, &stats);
+            fflush(stdout);
+            fflush(stderr);
+            _exit(stats.status);
+        }
+        int status = 0;
+        while (id != -1 && waitpid(id, &status, 0) == -1 && errno == EINTR)
+            ;
+        stats.status = id == -1 ? 1 : WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    } else
+        run_command(argc, argv, &stats);
+    fflush(stdout);
+    fflush(stderr);
+    record_paused = paused;
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+    return stats.status;
+}
+
+void on_watch_tick(int fd, void *data) {
+    *(int *)data += read_timer(fd);
+}
+
+int cmd_watch(int argc, char **argv) {
+    double interval = 2;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        char *end;
+        interval = strtod(argv[2], &end);
+        if (*end != '\0' || !(interval >= 0.1)) {
+            fprintf(stderr, "%swatch: interval must be at least 0.1 seconds%s\n", FG_RED, RESET);
+            return 1;
+        }
+        first = 3;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "%susage: watch [-n seconds] command [args]%s\n", FG_RED, RESET);
+        return 2;
+    }
+    if (strcmp(argv[first], "watch") == 0 || strcmp(argv[first], "exit") == 0) {
+        fprintf(stderr, "%swatch: can't watch %s%s\n", FG_RED, argv[first], RESET);
+        return 1;
+    }
+    int ticks = 1; // first run right away
+    int timer = event_add_timer(interval, true, on_watch_tick, &ticks);
+    int capture = memfd_create("watch", MFD_CLOEXEC);
+    if (timer == -1 || capture == -1) {
+        fprintf(stderr, "%swatch: %s%s\n", FG_RED, strerror(errno), RESET);
+        event_remove_timer(timer);
+        return 1;
+    }
+
+    char command[1000];
+    int command_length = 0;
+    for (int i = first; i < argc; i++)
+        command_length += snprintf(command + command_length, sizeof(command) - command_length,
+                                   "%s%.200s", i > first ? " " : "", argv[i]);
+
+    // q or ctrl-c stops, so signals are turned off while watching
+    enable_raw_mode();
+    struct termios config;
+    if (tcgetattr(STDIN_FILENO, &config) == 0) {
+        config.c_lflag &= ~ISIG;
+        tcsetattr(STDIN_FILENO, TCSANOW, &config);
+    }
+    listen_stdin(true);
+    printf("\e[?1049h\e[?25l\e[H\e[2J"); // alternate screen, hide cursor, clear
+
+    struct WatchFrame frames[2] = {0};
+    int current = 0;
+    bool has_previous = false;
+    char *raw = NULL;
+    size_t raw_capacity = 0;
+    int old_width = 0, old_height = 0;
+    char old_header[1100] = {'\0'};
+    bool highlighted[WATCH_MAX_ROWS] = {false};
+    bool running = true;
+    while (running) {
+        if (ticks == 0 && !terminal_resized) {
+            event_run_once(-1);
+            while (typeahead_start != typeahead_end) {
+                char c = getchar_unbuffered();
+                if (c == 'q' || c == 3)
+                    running = false;
+            }
+            running &= !stdin_eof;
+            continue;
+        }
+        ticks = 0;
+        terminal_resized = false;
+
+        int status = watch_run(argc - first, argv + first, capture);
+        off_t size = lseek(capture, 0, SEEK_END);
+        if ((size_t)size > raw_capacity) {
+            raw_capacity = size;
+            raw = realloc(raw, raw_capacity);
+        }
+        size = max(0, pread(capture, raw, size, 0));
+        struct WatchFrame *frame = &frames[current];
+        struct WatchFrame *previous = &frames[1 - current];
+        watch_parse(raw, size, frame);
+
+        int width = get_terminal_width();
+        int height = get_terminal_height();
+        if (width <= 0 || height <= 0) {
+            width = 80;
+            height = 24;
+        }
+        bool full = width != old_width || height != old_height;
+        if (full)
+            printf("\e[2J");
+        old_width = width;
+        old_height = height;
+
+        // header: command on the left, time on the right
+        char clock[64];
+        time_t now = time(NULL);
+        strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&now));
+        char header[1100];
+        int length = snprintf(header, sizeof(header), "Every %gs: %s", interval, command);
+        if (status != 0)
+            length += snprintf(header + length, sizeof(header) - length, " [%d]", status);
+        length = min(length, max(0, width - (int)strlen(clock) - 1));
+        snprintf(header + length, sizeof(header) - length, "%*s", width - length, clock);
+        watch_draw_line(1, header, strlen(header), full ? NULL : old_header, strlen(old_header), width, false);
+        strcpy(old_header, header);
+
+        for (int i = 0; i < height - 2; i++) {
+            const char *line = "", *old = "";
+            int line_length = 0, old_length = 0;
+            if (i < frame->line_count) {
+                line = frame->text + frame->lines[i];
+                line_length = frame->lines[i + 1] - frame->lines[i];
+            }
+            if (has_previous && i < previous->line_count) {
+                old = previous->text + previous->lines[i];
+                old_length = previous->lines[i + 1] - previous->lines[i];
+            }
+            // a line highlighted in the previous frame is redrawn to clear it
+            bool force = full || (i < WATCH_MAX_ROWS && highlighted[i]);
+            bool now_highlighted;
+            if (force && !full && line_length == old_length && memcmp(line, old, line_length) == 0)
+                now_highlighted = watch_draw_line(i + 3, line, line_length, NULL, 0, width, false);
+            else
+                now_highlighted = watch_draw_line(i + 3, line, line_length, full ? NULL : old, old_length,
+                                                  width, has_previous && !full);
+            if (i < WATCH_MAX_ROWS)
+                highlighted[i] = now_highlighted;
+        }
+        fflush(stdout);
+        has_previous = true;
+        current = 1 - current;
+        running &= stdin_listening; // nothing could stop it otherwise
+    }
+
+    printf("\e[?25h\e[?1049l"); // show cursor, leave alternate screen
+    fflush(stdout);
+    listen_stdin(false);
+    disable_raw_mode();
+    for (int i = 0; i < 2; i++) {
+        free(frames[i].text);
+        free(frames[i].lines);
+    }
+    free(raw);
+    close(capture);
+    event_remove_timer(timer);
+    return 0;
+}
+
+void free_args(char **args) {
+    for (int i = 0; i < max_word_count; i++)
+        free(args[i]);
+    free(args);
+}
+
+// builtins which would change the shell, they run in a child like in a POSIX subshell
+bool changes_shell_state(const char *name) {
+    const char *names[] = {"exit", "cd", "pushd", "popd", "dirs", "z", "watch", "stats", "trace", "record", NULL};
+    for (int i = 0; names[i] != NULL; i++) {
+        if (strcmp(names[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+// runs command with its output captured into a malloc'ed buffer, builtins
+// run in-process and print straight into it, external commands through a pipe
+// returns the exit status of the command
+int command_substitution(const char *command, int length, char **output, size_t *size) {
+    char *line = strndup(command, length);
+    // parse_arguments puts NULL after the last argument, words keeps all of them
+    char **args = malloc(max_word_count * sizeof(char*));
+    char **words = malloc(max_word_count * sizeof(char*));
+    for (int i = 0; i < max_word_count; i++)
+        args[i] = words[i] = malloc(max_word_length);
+    int count = parse_arguments(line, args);
+    free(line);
+
+    fflush(stdout);
+    FILE *saved = stdout;
+    stdout = open_memstream(output, size);
+    int status = 0;
+    if (count > 0 && changes_shell_state(args[command_start(count, args)])) {
+        int fds[2] = {-1, -1};
+        pid_t id = pipe2(fds, O_CLOEXEC) == -1 ? -1 : fork();
+        if (id == 0) {
+            sigprocmask(SIG_SETMASK, &original_signal_mask, NULL);
+            dup2(fds[1], STDOUT_FILENO);
+            stdout = saved;
+            struct CommandStats stats;
+            run_command(count, args, &stats);
+            fflush(stdout);
+            _exit(stats.status);
+        }
+        if (id != -1) {
+            close(fds[1]);
+            copy_fd_to_stream(fds[0], stdout);
+            close(fds[0]);
+            int wait_status = 0;
+            while (waitpid(id, &wait_status, 0) == -1 && errno == EINTR)
+                ;
+            status = WIFSIGNALED(wait_status) ? 128 + WTERMSIG(wait_status) : WEXITSTATUS(wait_status);
+        } else {
+            fprintf(stderr, "%sError: %s%s\n", FG_RED, strerror(errno), RESET);
+            for (int i = 0; i < 2; i++) {
+                if (fds[i] != -1)
+                    close(fds[i]);
+            }
+            status = 1;
+        }
+    } else if (count > 0) {
+        struct CommandStats stats;
+        status = run_command(count, args, &stats);
+    }
+    fclose(stdout);
+    stdout = saved;
 
-    // adjuest size
-    *size -= removed_count;
-    (*size)++; // one new was added
+    free(args);
+    free_args(words);
+    return status;
 }
 
+// Server mode: `microshell --serve path [workers]` listens on a unix socket
+// and runs requests on pre-forked workers, which stay warm between requests
+// (locale, command cache and z index are loaded once). Both directions are
+// frames: a type byte, the payload length as uint32 in host byte order and
+// the payload. A request is any number of FRAME_CWD and FRAME_ENV ("NAME=VALUE")
+// frames followed by FRAME_LINE, the reply is FRAME_STDOUT and FRAME_STDERR
+// chunks as the command writes them and FRAME_STATUS with the exit status as
+// int32. A connection may send requests one after another, the worker resets
+// its cwd and environment after each of them.
+#define SERVE_WORKERS 4 // default size of the pool
+#define SERVE_MAX_WORKERS 64
+#define FRAME_MAX (1 << 24) // longest payload accepted from the other side
 
-// isdigit extened by '.' for parsing floating point numbers
-bool isdigitx(char c) {
-    return isdigit(c) || c == '.';
-}
+enum FrameType {
+    FRAME_CWD = 'C',
+    FRAME_ENV = 'V',
+    FRAME_LINE = 'L',
+    FRAME_STDOUT = 'O',
+    FRAME_STDERR = 'E',
+    FRAME_STATUS = 'S',
+};
 
-bool is_digits_buffer_zero(const char * const db) {
-    for (int i = 0; db[i] != '\0'; i++) {
-        if (db[i] != '0' && db[i] != '.')
+// header and payload go out in one sendmsg, MSG_NOSIGNAL keeps a worker alive
+// when its client is gone
+bool send_frame(int fd, char type, const void *payload, uint32_t length) {
+    char header[5];
+    header[0] = type;
+    memcpy(header + 1, &length, sizeof(length));
+    struct iovec parts[2] = {{header, sizeof(header)}, {(void *)payload, length}};
+    struct msghdr message = {.msg_iov = parts, .msg_iovlen = 2};
+    while (message.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
             return false;
+        }
+        while (message.msg_iovlen > 0 && (size_t)n >= message.msg_iov->iov_len) {
+            n -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (char *)message.msg_iov->iov_base + n;
+            message.msg_iov->iov_len -= n;
+        }
     }
     return true;
 }
 
-// returns true on success, false on failure
-bool parse_digits(char *db, double *out) {
-    int dot_pos = -1;
-    int length = 0; // number of digits
-    for (int i = 0; db[i] != '\0'; i++) {
-        if (db[i] == '.') {
-            if (dot_pos == -1)
-                dot_pos = i;
-            else {
-                fprintf(stderr, "%sError: Multiple dots in parsed string%s\n", FG_RED, RESET);
-                return false;
-            }
-        } else
-            length++;
+bool read_full(int fd, void *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, data, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data = (char *)data + n;
+        size -= n;
     }
-    if (dot_pos == -1)
-        dot_pos = length;
-    // dot_pos = (number of digits before the dot)
-    // length - dot_pos = (number of digits after the dot)
-    double num = 0;
-    double power = 1;
-    for (int i = dot_pos - 1; i >= 0; i--) {
-        num += (db[i] - '0') * power;
-        power *= 10;
-    }
-    power = .1;
-    for (int i = dot_pos + 1; i <= length; i++) {
-        num += (db[i] - '0') * power;
-        power /= 10;
-    }
-    *out = num;
     return true;
 }
 
-// returns true on success, false on failure
-bool perform_token2(struct MathToken *tokens, int *size, int oper_idx, double (*f)(double, double)) {
-    if (oper_idx == 0 || oper_idx == *size - 1) {
-        fprintf(stderr, "%sError #1: missing operand%s\n", FG_RED, RESET);
-        return false;
-    }
-    struct MathToken *lop = &tokens[oper_idx - 1]; // left operand
-    struct MathToken *rop = &tokens[oper_idx + 1]; // right operand
-    if (lop->nesting_level != tokens[oper_idx].nesting_level ||
-            rop->nesting_level != tokens[oper_idx].nesting_level) {
-        fprintf(stderr, "%sError #2: wrong nesting level of operands%s\n", FG_RED, RESET);
-        return false;
-    }
-    if (lop->operation != '\0' || rop->operation != '\0') {
-        fprintf(stderr, "%sError #3: wrong operands%s\n", FG_RED, RESET);
-        return false;
+bool write_full(int fd, const void *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data = (const char *)data + n;
+        size -= n;
     }
-    // replace tokens oper_idx-1, oper_idx, oper_idx+1 with new result token
-    struct MathToken result;
-    result.value = f(lop->value, rop->value);
-    result.operation = '\0';
-    // set nesting level of result to the highest nesting level of neigboring tokens
-    // After addition those tokens are token[oper_idx - 2] and token[oper_idx + 2].
-    int left_nl = 0;
-    if (oper_idx - 2 >= 0)
-        left_nl = tokens[oper_idx - 2].nesting_level;
-    int right_nl = 0;
-    if (oper_idx + 2 < *size)
-        left_nl = tokens[oper_idx + 2].nesting_level;
-    int nl = max(left_nl, right_nl);
-    result.nesting_level = nl;
-    replace_tokens(tokens, size, oper_idx - 1, oper_idx + 1, &result);
     return true;
 }
 
-// returns true on success, false on failure
-bool perform_token1(struct MathToken *tokens, int *size, int oper_idx, double (*f)(double)) {
-    // make sure there is a token on the right
-    if (oper_idx == *size - 1) {
-        fprintf(stderr, "%sError #1: missing operand%s\n", FG_RED, RESET);
+// payload is a buffer reused between calls, it is NUL terminated
+bool receive_frame(int fd, char *type, char **payload, size_t *capacity, uint32_t *length) {
+    char header[5];
+    if (!read_full(fd, header, sizeof(header)))
         return false;
-    }
-    // make sure token on the right is a number with same nesting level
-    if (tokens[oper_idx + 1].operation != '\0' ||
-        tokens[oper_idx + 1].nesting_level != tokens[oper_idx].nesting_level) {
-        fprintf(stderr, "%sError #2: wrong operand%s\n", FG_RED, RESET);
+    *type = header[0];
+    memcpy(length, header + 1, sizeof(*length));
+    if (*length > FRAME_MAX)
         return false;
+    if (*length + 1 > *capacity) {
+        *capacity = *length + 1;
+        *payload = realloc(*payload, *capacity);
     }
-    struct MathToken *rop = &tokens[oper_idx + 1]; // right operand
-    // replace tokens oper_idx, oper_idx, oper_idx+1 with new result token
-    struct MathToken result;
-    result.value = f(rop->value);
-    result.operation = '\0';
-    // set nesting level of result to the highest nesting level of neigboring tokens
-    // After addition those tokens are token[oper_idx - 2] and token[oper_idx + 2].
-    int left_nl = 0;
-    if (oper_idx - 2 >= 0)
-        left_nl = tokens[oper_idx - 2].nesting_level;
-    int right_nl = 0;
-    if (oper_idx + 2 < *size)
-        left_nl = tokens[oper_idx + 2].nesting_level;
-    int nl = max(left_nl, right_nl);
-    result.nesting_level = nl;
-    replace_tokens(tokens, size, oper_idx, oper_idx + 1, &result);
-    return true;
+    (*payload)[*length] = '\0';
+    return read_full(fd, *payload, *length);
 }
 
-double op_addition(double a, double b) {
-    return a + b;
-}
+// stdout and stderr of a worker are cookie streams which send what is
+// written as frames, fileno of them is -1 so external commands get pipes
+struct FrameStream {
+    int fd;
+    char type;
+};
 
-double op_subtraction(double a, double b) {
-    return a - b;
+ssize_t frame_stream_write(void *cookie, const char *data, size_t size) {
+    struct FrameStream *frames = cookie;
+    // if the client went away the command still runs to the end
+    send_frame(frames->fd, frames->type, data, size);
+    return size;
 }
 
-double op_opposite(double a) {
-    return -a;
+int serve_line(int client, const char *line) {
+    struct FrameStream out = {client, FRAME_STDOUT};
+    struct FrameStream err = {client, FRAME_STDERR};
+    cookie_io_functions_t io = {.write = frame_stream_write};
+    FILE *saved_stdout = stdout;
+    FILE *saved_stderr = stderr;
+    stdout = fopencookie(&out, "w", io);
+    stderr = fopencookie(&err, "w", io);
+    setvbuf(stderr, NULL, _IONBF, 0);
+
+    char **args = malloc(max_word_count * sizeof(char*));
+    char **words = malloc(max_word_count * sizeof(char*));
+    for (int i = 0; i < max_word_count; i++)
+        args[i] = words[i] = malloc(max_word_length);
+    int count = parse_arguments(line, args);
+    int first = command_start(count, args);
+    int status = 0;
+    if (count == 0)
+        ; // skip
+    else if (strcmp(args[first], "exit") == 0 || strcmp(args[first], "watch") == 0 || strcmp(args[first], "record") == 0) {
+        // exit would end the worker, watch needs a terminal and recording
+        // would swap stdout of the worker for the streams of later requests
+        fprintf(stderr, "%s%s is not available in server mode%s\n", FG_RED, args[first], RESET);
+        status = 2;
+    } else {
+        struct CommandStats stats;
+        status = run_command(count, args, &stats);
+    }
+    last_status = status;
+    free(args);
+    free_args(words);
+
+    fclose(stdout);
+    fclose(stderr);
+    stdout = saved_stdout;
+    stderr = saved_stderr;
+    return status;
 }
 
-double op_multiplication(double a, double b) {
-    return a * b;
+void serve_error(int client, const char *what, const char *value) {
+    char message[PATH_MAX + 128];
+    int length = snprintf(message, sizeof(message), "%s%s: %s: %s%s\n", FG_RED, what, value, strerror(errno), RESET);
+    send_frame(client, FRAME_STDERR, message, min(length, sizeof(message) - 1));
 }
 
-double op_division(double a, double b) {
-    return a / b;
+char **serve_environment; // environment the worker started with, restored after each request
+// NAME=VALUE strings sent with the current request, putenv doesn't copy them
+// and setenv would keep every value for the worker's whole life
+char **serve_sent_environment = NULL;
+int serve_sent_count = 0, serve_sent_capacity = 0;
+
+// A worker serves one client after another, so whatever a request changed is
+// put back to how the worker started: cwd, environment and the shell state of
+// pushd, cd -, stats, trace and z.
+void serve_reset(int home) {
+    if (home != -1)
+        fchdir(home);
+    clearenv();
+    for (int i = 0; serve_environment[i] != NULL; i++)
+        putenv(serve_environment[i]);
+    for (int i = 0; i < serve_sent_count; i++)
+        free(serve_sent_environment[i]);
+    serve_sent_count = 0;
+    while (dir_stack_top > 0)
+        free(dir_stack[--dir_stack_top]);
+    last_cd_location[0] = '\0';
+    show_stats = false;
+    tracing = false;
+    trace_head = 0;
+    z_loaded = false; // read again from the file of the next request's HOME
 }
 
-double op_exponentiation(double a, double b) {
-    return pow(a, b);
+void serve_connection(int client) {
+    int home = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    char *payload = NULL;
+    size_t capacity = 0;
+    uint32_t length;
+    char type;
+    bool failed = false; // a cwd or env frame couldn't be applied
+    last_status = 0;
+    while (receive_frame(client, &type, &payload, &capacity, &length)) {
+        if (type == FRAME_CWD && chdir(payload) == -1) {
+            serve_error(client, "cd", payload);
+            failed = true;
+        } else if (type == FRAME_ENV) {
+            char *equals = strchr(payload, '=');
+            if (equals == NULL || equals == payload) {
+                errno = EINVAL;
+                serve_error(client, "env", payload);
+                failed = true;
+            } else {
+                if (serve_sent_count == serve_sent_capacity) {
+                    serve_sent_capacity = max(16, serve_sent_capacity * 2);
+                    serve_sent_environment = realloc(serve_sent_environment, serve_sent_capacity * sizeof(char*));
+                }
+                char *entry = strdup(payload);
+                serve_sent_environment[serve_sent_count++] = entry;
+                putenv(entry);
+            }
+        } else if (type == FRAME_LINE) {
+            int status = failed ? 1 : serve_line(client, payload);
+            if (!send_frame(client, FRAME_STATUS, &status, sizeof(status)))
+                break;
+            failed = false;
+            serve_reset(home);
+        }
+    }
+    free(payload);
+    serve_reset(home);
+    if (home != -1)
+        close(home);
 }
 
-void cmd_calc(int argc, char **argv) {
-    if (argc == 1) {
-        fprintf(stderr, "%sprovide expression, e.g. (2 + 2) * 8%s\n", FG_RED, RESET);
-        printf("supported operations:\n");
-        printf("  + - addtion\n");
-        printf("  - - subtraction\n");
-        printf("  * - multiplication\n");
-        printf("  / - division\n");
-        printf("  ^ - exponentiation\n");
-        return;
+void serve_worker(int listener) {
+    event_loop_init();
+    int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null != -1) {
+        dup2(null, STDIN_FILENO);
+        close(null);
     }
-    // merge argv into expression
-    char expression[1000];
-    int idx = 0;
-    for (int i = 1; i < argc; i++) {
-        strcpy(expression + idx, argv[i]);
-        idx += strlen(argv[i]);
+    int count = 0;
+    while (environ != NULL && environ[count] != NULL)
+        count++;
+    serve_environment = malloc((count + 1) * sizeof(char*));
+    for (int i = 0; i < count; i++)
+        serve_environment[i] = strdup(environ[i]);
+    serve_environment[count] = NULL;
+
+    // all workers block in accept on the same socket, the kernel wakes one
+    while (true) {
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+        serve_connection(client);
+        close(client);
     }
-    // remove whitespace
-    int lgc = -1; // index of last graphic character
-    for (int i = 0; i < strlen(expression); i++) {
-        if (isgraph(expression[i]))
-            expression[++lgc] = expression[i];
+}
+
+pid_t serve_spawn(int listener, int signals) {
+    pid_t id = fork();
+    if (id == 0) {
+        close(signals);
+        sigprocmask(SIG_SETMASK, &original_signal_mask, NULL);
+        serve_worker(listener);
     }
-    // replace ',' with '.'
-    for (int i = 0; i < strlen(expression); i++) {
-        if (expression[i] == ',')
-            expression[i] = '.';
+    return id;
+}
+
+bool socket_address(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
     }
-    // check characters
-    for (int i = 0; i < strlen(expression); i++) {
-        if (!isdigit(expression[i]) &&
-                expression[i] != '+' &&
-                expression[i] != '-' &&
-                expression[i] != '*' &&
-                expression[i] != '/' &&
-                expression[i] != '^' &&
-                expression[i] != '(' &&
-                expression[i] != ')' &&
-                expression[i] != '.') {
-            fprintf(stderr, "%sinvalid character %c\n", FG_RED, expression[i]);
-            fprintf(stderr, "%s\n", expression);
-            for(int j = 0; j < i; j++)
-                fprintf(stderr, " ");
-            fprintf(stderr, "^%s\n", RESET);
-            return;
-        }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+// returns the exit status for main
+int serve(const char *path, int workers) {
+    struct sockaddr_un address;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!socket_address(path, &address) || listener == -1) {
+        fprintf(stderr, "%sserve: %s: %s%s\n", FG_RED, path, strerror(errno), RESET);
+        return 1;
     }
-    // check parenthesis
-    int open_count = 0;
-    for (int i = 0; i < strlen(expression); i++) {
-        if (expression[i] == '(')
-            open_count++;
-        if (expression[i] == ')')
-            open_count--;
-        if (open_count < 0) {
-            fprintf(stderr, "%smissing opening bracket\n", FG_RED);
-            fprintf(stderr, "%s\n", expression);
-            for (int j = 0; j < i; j++)
-                fprintf(stderr, " ");
-            fprintf(stderr, "^%s\n", RESET);
-            return;
-        }
+    // a socket left behind by a server which didn't shut down, nobody accepts on it
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(probe, (struct sockaddr *)&address, sizeof(address)) == -1 && errno == ECONNREFUSED)
+            unlink(path);
+        close(probe);
     }
-    if (open_count > 0) {
-        fprintf(stderr, "%sError: missing closing bracket%s\n", FG_RED, RESET);
-        return;
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, 128) == -1) {
+        fprintf(stderr, "%sserve: %s: %s%s\n", FG_RED, path, strerror(errno), RESET);
+        return 1;
     }
-    printf("%s = ?\n", expression);
-    // tokenize
-    struct MathToken tokens[1000];
-    int tokens_size = 0;
-    int nesting_level = 0;
-    char digits_buffer[1000];
-    memset(digits_buffer, 0, 1000);
-    int db_idx = 0;
-    for (int i = 0; i < strlen(expression); i++) {
-        if (isdigitx(expression[i])) {
-            digits_buffer[db_idx++] = expression[i];
-        } else {
-            if (db_idx > 0) {
-                double num = 0;
-                bool succ = parse_digits(digits_buffer, &num);
-                if (!succ) {
-                    fprintf(stderr, "%sError: couldn't parse %s%s\n", digits_buffer, FG_RED, RESET);
-                    return;
-                }
-                memset(digits_buffer, 0, 1000);
-                db_idx = 0;
-                push_value_token(tokens, &tokens_size, num, nesting_level);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, &original_signal_mask);
+    int signals_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    pid_t pids[SERVE_MAX_WORKERS];
+    for (int i = 0; i < workers; i++)
+        pids[i] = serve_spawn(listener, signals_fd);
+    fprintf(stderr, "serving on %s with %d workers\n", path, workers);
+
+    // workers which died are replaced until SIGINT or SIGTERM
+    struct signalfd_siginfo signal;
+    while (signals_fd != -1) {
+        if (read(signals_fd, &signal, sizeof(signal)) != sizeof(signal))
+            continue;
+        if (signal.ssi_signo != SIGCHLD)
+            break;
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (int i = 0; i < workers; i++) {
+                if (pids[i] == pid)
+                    pids[i] = serve_spawn(listener, signals_fd);
             }
-            if (expression[i] == '(')
-                nesting_level++;
-            else if (expression[i] == ')')
-                nesting_level--;
-            else
-                push_operation_token(tokens, &tokens_size, expression[i], nesting_level);
         }
     }
-    if (db_idx > 0) {
-        double num = 0;
-        bool succ = parse_digits(digits_buffer, &num);
-        if (!succ) {
-            fprintf(stderr, "%sError: couldn't parse %s%s\n", digits_buffer, FG_RED, RESET);
-            return;
-        }
-        memset(digits_buffer, 0, 1000);
-        db_idx = 0;
-        push_value_token(tokens, &tokens_size, num, nesting_level);
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
     }
-    // evaluate expression
-    while (tokens_size > 1) {
-        print_tokens(tokens, tokens_size);
+    while (wait(NULL) > 0)
+        ;
+    unlink(path);
+    close(listener);
+    return 0;
+}
 
-        // find operation with highest priority
-        int highest_priority = -1;
-        int oper_idx = -1;
-        for (int i = 0; i < tokens_size; i++) {
-            if (tokens[i].operation != '\0') {
-                int op = operation_priority(&tokens[i]);
-                if (op > highest_priority) {
-                    highest_priority = op;
-                    oper_idx = i;
-                }
-            }
+int client_connect(const char *path) {
+    struct sockaddr_un address;
+    if (!socket_address(path, &address))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
+// sends one request and copies the output to out and err,
+// returns the exit status of the command or -1 if the connection broke
+int client_request(int fd, const char *cwd, char **env, int env_count, const char *line, int out, int err) {
+    if (cwd != NULL && !send_frame(fd, FRAME_CWD, cwd, strlen(cwd)))
+        return -1;
+    for (int i = 0; i < env_count; i++) {
+        if (!send_frame(fd, FRAME_ENV, env[i], strlen(env[i])))
+            return -1;
+    }
+    if (!send_frame(fd, FRAME_LINE, line, strlen(line)))
+        return -1;
+    static char *payload = NULL;
+    static size_t capacity = 0;
+    uint32_t length;
+    char type;
+    while (receive_frame(fd, &type, &payload, &capacity, &length)) {
+        if (type == FRAME_STATUS && length == sizeof(int)) {
+            int status;
+            memcpy(&status, payload, sizeof(status));
+            return status;
         }
-        if (oper_idx == -1) {
-            fprintf(stderr, "%sError: no operations%s\n", FG_RED, RESET);
-            return;
-        }
-        // perform operation
-        bool succ = false;
-        switch (tokens[oper_idx].operation) {
-            case '+': {
-                succ = perform_token2(tokens, &tokens_size, oper_idx, op_addition);
-                break;
-            }
-            case '-': {
-                // is token on left a number
-                if (tokens[oper_idx - 1].operation == '\0' &&
-                    tokens[oper_idx - 1].nesting_level == tokens[oper_idx].nesting_level)
-                    succ = perform_token2(tokens, &tokens_size, oper_idx, op_subtraction);
-                else
-                    succ = perform_token1(tokens, &tokens_size, oper_idx, op_opposite);
-                break;
-            }
-            case '*': {
-                succ = perform_token2(tokens, &tokens_size, oper_idx, op_multiplication);
-                break;
-            }
-            case '/': {
-                succ = perform_token2(tokens, &tokens_size, oper_idx, op_division);
-                break;
-            }
-            case '^': {
-                succ = perform_token2(tokens, &tokens_size, oper_idx, op_exponentiation);
-                break;
-            }
+        if (type == FRAME_STDOUT || type == FRAME_STDERR)
+            write_full(type == FRAME_STDOUT ? out : err, payload, length);
+    }
+    return -1;
+}
+
+// `microshell --client path [-C dir] [-e NAME=VALUE]... [command]`, without
+// a command every line of stdin is a request over the same connection
+int client_main(int argc, char **argv) {
+    if (argc < 1) {
+        fprintf(stderr, "%susage: --client path [-C dir] [-e NAME=VALUE]... [command]%s\n", FG_RED, RESET);
+        return 2;
+    }
+    char cwd[PATH_MAX];
+    char *dir = getcwd(cwd, sizeof(cwd));
+    char **env = malloc(argc * sizeof(char*));
+    int env_count = 0;
+    int i = 1;
+    for (; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-C") == 0)
+            dir = argv[i + 1];
+        else if (strcmp(argv[i], "-e") == 0)
+            env[env_count++] = argv[i + 1];
+        else
+            break;
+    }
+    int fd = client_connect(argv[0]);
+    if (fd == -1) {
+        fprintf(stderr, "%sclient: %s: %s%s\n", FG_RED, argv[0], strerror(errno), RESET);
+        free(env);
+        return 1;
+    }
+    int status = 0;
+    if (i < argc) {
+        // words of the command are joined like the arguments of echo
+        size_t size = 1;
+        for (int j = i; j < argc; j++)
+            size += strlen(argv[j]) + 1;
+        char *line = calloc(size, 1);
+        for (int j = i; j < argc; j++) {
+            strcat(line, argv[j]);
+            if (j + 1 < argc)
+                strcat(line, " ");
         }
-        if (!succ) {
-            fprintf(stderr, "%sError: operation failed%s\n", FG_RED, RESET);
-            return;
+        status = client_request(fd, dir, env, env_count, line, STDOUT_FILENO, STDERR_FILENO);
+        free(line);
+    } else {
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t length;
+        while (status != -1 && (length = getline(&line, &size, stdin)) != -1) {
+            if (length > 0 && line[length - 1] == '\n')
+                line[length - 1] = '\0';
+            status = client_request(fd, dir, env, env_count, line, STDOUT_FILENO, STDERR_FILENO);
         }
-        printf("\n");
+        free(line);
     }
-    // print results
-    printf("%s%f%s\n", FG_GREEN, tokens[0].value, RESET);
+    if (status == -1)
+        fprintf(stderr, "%sclient: connection to %s broke%s\n", FG_RED, argv[0], RESET);
+    close(fd);
+    free(env);
+    return status == -1 ? 1 : status;
 }
 
-void free_args(char **args) {
+// `microshell -c line` runs one command line and exits with its status
+int run_line(const char *line) {
+    char **args = malloc(max_word_count * sizeof(char*));
+    char **words = malloc(max_word_count * sizeof(char*));
     for (int i = 0; i < max_word_count; i++)
-        free(args[i]);
+        args[i] = words[i] = malloc(max_word_length);
+    int count = parse_arguments(line, args);
+    int status = 0;
+    if (count > 0) {
+        struct CommandStats stats;
+        status = run_command(count, args, &stats);
+    }
     free(args);
+    free_args(words);
+    fflush(stdout);
+    return status;
 }
 
-int main() {
+// benchmarks include this file and provide their own main
+#ifndef MICROSHELL_NO_MAIN
+int main(int argc, char **argv) {
     setlocale(LC_ALL, "en_EN.utf8");
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0) {
+        int workers = argc > 3 ? atoi(argv[3]) : SERVE_WORKERS;
+        return serve(argv[2], max(1, min(workers, SERVE_MAX_WORKERS)));
+    }
+    if (argc > 1 && strcmp(argv[1], "--client") == 0)
+        return client_main(argc - 2, argv + 2);
+    event_loop_init();
+    if (argc > 2 && strcmp(argv[1], "-c") == 0)
+        return run_line(argv[2]);
     // main loop
     while (true) {
         char *line = malloc(user_buffer_size);
@@ -1048,23 +6133,18 @@ int main() {
         else if (strcmp(args[0], "exit") == 0) {
             free_args(args);
             cmd_exit();
-        } else if (strcmp(args[0], "cd") == 0)
-            cmd_cd(count, args);
-        else if (strcmp(args[0], "type") == 0)
-            cmd_type(count, args);
-        else if (strcmp(args[0], "args") == 0)
-            cmd_args(count, args);
-        else if (strcmp(args[0], "help") == 0)
-            cmd_help();
-        else if (strcmp(args[0], "ps") == 0)
-            cmd_ps();
-        else if (strcmp(args[0], "calc") == 0)
-            cmd_calc(count, args);
-        else
-            execute_command(args[0], args, count);
+        } else {
+            struct CommandStats stats;
+            run_command(count, args, &stats);
+            history_stats[his_top - 1] = stats;
+            history_has_stats[his_top - 1] = true;
+            if (show_stats)
+                print_command_stats(&stats);
+            prompt_on_command_done(stats.status, stats.real);
+        }
 
         free_args(args);
     }
     return 0;
 }
-
+#endif